@@ -20,901 +20,2391 @@
  *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
-#include <sys/io.h> /* for outb() and inb() */
+#define _GNU_SOURCE /* for sched_setaffinity() */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sched.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h> /* needed for ioperm() */
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "lbp660.h"
 
-static struct printer
-{
-	const char *name;
-	int lines_by_page;
-} printers[] = {
-	{
-		.name = "LBP-460",
-		.lines_by_page = 3484,
-	}, {
-		.name = "LBP-660",
-		.lines_by_page = 6968,
-	}, {
-		NULL
-	}
-};
-
-static int pagedata[] =
-{
-	-1, 0x89, /*100*/
-	-1, 0x8a, /*172*/
-	-1, 0x8b, /*244*/
-	-3, 0x8b, 0x89, 0x8c, /*333*/
-	-7, 0x8c, 0x4, 0x94, 0x3f, 0x95, 0x58, 0x94, /*456*/
-	-1, 0x95, /*528*/
-	-1, 0x89, /*600*/
-	-1, 0x8a, /*672*/
-	-1, 0x8b, /*744*/
-	-1, 0x89, /*816*/
-	-1, 0x8a, /*888*/
-	-1, 0x8b, /*960*/
-	-3, 0x8b, 0x89, 0x90, /*1049*/
-	-5, 0x91, 0x0, 0x90, 0x0, 0x89, /*1155*/
-	-1, 0x8a, /*1227*/
-	-1, 0x8b, /*1299*/
-	-1, 0x89, /*1372*/
-	-1, 0x8a, /*1444*/
-	-3, 0x8d, 0xa7, 0x8b, /*1533*/
-	-3, 0x8b, 0x8a, 0x90, /*1622*/
-	-3, 0x90, 0x8, 0x89, /*1712*/
-	-1, 0x8a, /*1784*/
-	-1, 0x8e, /*1856*/
-	-1, 0x90, /*1928*/
-	-3, 0x90, 0x9, 0x89, /*2018*/
-	-1, 0x8a, /*2090*/
-	-3, 0x8d, 0x40, 0x90, /*2179*/
-	-5, 0x90, 0xc9, 0xa0, 0x0, 0xa0, /*2285*/
-	-17, 0x81, 0xdc, 0x82, 0x0, 0x83, 0x61, 0x84, 0x0, 0x85,
-	0x58, 0x86, 0x2, 0x87, 0x9c, 0x88, 0x1a, 0x81, /*2493*/
-	-1, 0x82, /*2565*/
-	-1, 0x83, /*2637*/
-	-1, 0x84, /*2709*/
-	-1, 0x85, /*2781*/
-	-1, 0x86, /*2853*/
-	-1, 0x87, /*2925*/
-	-1, 0x88, /*2997*/
-	-1, 0x89, /*3070*/
-	-1, 0x8a, /*3142*/
-	-1, 0x8e, /*3214*/
-	-1, 0x89, /*3287*/
-	-1, 0x8a, /*3359*/
-	-3, 0x8d, 0x2, 0x89, /*3449*/
-	-1, 0x8a, /*3521*/
-	-1, 0x8e, /*3593*/
-	-1, 0x89, /*3666*/
-	-1, 0x8a, /*3738*/
-	-3, 0x8d, 0x9d, 0x89, /*3828*/
-	-1, 0x8a, /*3900*/
-	-1, 0x8e, /*3972*/
-	-1, 0x89, /*4045*/
-	-1, 0x8a, /*4117*/
-	-3, 0x8d, 0x2, 0x89, /*4207*/
-	-1, 0x8a, /*4279*/
-	-1, 0x8e, /*4351*/
-	-3, 0x93, 0x0, 0x89, /*4441*/
-	-1, 0x8a, /*4513*/
-	-3, 0x8d, 0x2, 0x89, /*4603*/
-	-1, 0x8a, /*4675*/
-	-1, 0x8e, /*4747*/
-	-1, 0x89, /*4820*/
-	-1, 0x8a, /*4892*/
-	-1, 0x89, /*4965*/
-	-1, 0x8a,
-	-256,
-	-260 }; //, /*5037*/
-
-static int bandinit[] =
-{
-	-1, 0x8a, /*25157*/
-	-1, 0x8e, /*25229*/
-	-1, 0x89, /*25302*/
-	-1, 0x8a, /*25374*/
-	-1, 0x89, /*25447*/
-	-1, 0x8a, /*25519*/
-	-3, 0x8d, 0x1, 0x89, /*25609*/
-	-1, 0x8a, /*25681*/
-	-1, 0x89, /*25754*/
-	-1, 0x8a, /*25826*/
-	//-3, 0x80, 0xff, 0x7f, /*25909*/
-	-256, /* data */
-	-260
-};
-
-void INLINE errorexit();
+static void errorexit (void);
 
 static int lines_by_page;
 
 /* Rildo Pragana constants and functions */
 static FILE *cbmf = NULL;
-static int bmcnt = 0;
-static unsigned char bmbuf[800]; 	/* the pbm bitmap line with provision for leftskip */
-static unsigned char *bmptr = bmbuf;
+static struct
+{
+	long start;	/* offset of the page in cbmf */
+	int chunks;	/* number of chunks (size word and packets) */
+	int next;	/* next chunk to read */
+	long black;	/* black pixels, -1 if not known */
+} cpage;
+static unsigned char bmbuf[800 + 4]; 	/* the pbm bitmap line with provision for leftskip */
 static int bmwidth = 0, bmheight = 0;
-static unsigned char cbm[300000];	/* the compressed bitmap */
-static unsigned char garbage[600];
-static unsigned char *cbmp = cbm;
-static int csize = 0;				/* compressed line size */
+static int bmpixels = 0;	/* width in pixels */
+static int bmformat = '4';	/* P4, P1 or P7 */
+static int pam_depth = 1;	/* samples by pixel */
+static unsigned char cbm[MAX_PACKET_COUNT * 4];	/* a chunk of packets */
 static int linecnt = 0;
-static int pktcnt;
 static int topskip = 0;
 static int leftskip = 0;
+static unsigned char *vpage = NULL;	/* raw page kept for the round-trip check */
 
-static void message (char *fmt, ...)
+/* Black pixels counted while compressing. The job totals add the
+ * count of the page for every sheet printed, copies included.
+ */
+static struct
 {
-	va_list args;
-	va_start (args, fmt);
-	vfprintf (stderr, fmt, args);
-	va_end (args);
-}
+	long page;
+	long band_max;	/* densest band of the page */
+	long job;
+	int pages;
+	int unknown;	/* sheets without a count (version 1 job files) */
+} cov;
+
+/* Encoding time by band class */
+struct enc_stat
+{
+	int bands;
+	long bytes;
+	long usec;
+};
+static struct enc_stat enc_stats[LBP_BAND_CLASSES];
+static const char *band_class[LBP_BAND_CLASSES] = { "blank", "sparse", "dense" };
 
+/* Real-time transmit mode (-F) */
+static int rt_cpu = -1;		/* core running the transmit, -1 when off */
+static int rt_active = 0;	/* inside the transmit */
+static cpu_set_t rt_mask;	/* affinity outside the transmit */
+static char rt_log[65536];	/* messages held back during the transmit */
+static int rt_loglen = 0;
+static int rt_logdrop = 0;
 
-static void bitmap_seek (FILE *bitmapf, int offset)
+static struct lbp_latency rt_job;
+
+static struct lbp_transport tp;
+
+/* Also the log of the transport */
+static void vmessage (void *arg, const char *fmt, va_list args)
 {
-	if (offset)
-	{
-		while (offset > sizeof(garbage))
+	int len;
+	if (rt_active)
+	{ /* stderr may block, keep it out of the transmit */
+		len = vsnprintf (rt_log + rt_loglen, sizeof (rt_log) - rt_loglen,
+				 fmt, args);
+		if (len >= sizeof (rt_log) - rt_loglen)
 		{
-			fread(bmbuf,1,sizeof(garbage),bitmapf);
-			offset -= sizeof(garbage);
+			rt_log[rt_loglen] = 0;
+			rt_logdrop++;
+		} else {
+			rt_loglen += len;
 		}
-		fread(bmbuf,1,offset,bitmapf);
+	} else {
+		vfprintf (stderr, fmt, args);
 	}
 }
 
-static unsigned char get_bitmap (FILE *bitmapf)
+static void message (const char *fmt, ...)
 {
-	if (bmcnt == 0)
-	{
-		memset (bmbuf, 0, 800);
-		if (linecnt < (bmheight - topskip))
-		{
-			if (bmwidth > 800)
-			{
-				fread (bmbuf, 1, 800, bitmapf);
-				bitmap_seek (bitmapf, bmwidth - 800);
-			} else {
-				fread (bmbuf, 1, bmwidth, bitmapf);
-			}
-		}
-		bmptr = bmbuf + leftskip / 8;
-		bmcnt = LINE_SIZE;
-		linecnt++;
-	}
-	bmcnt--;
-	return *bmptr++;
+	va_list args;
+	va_start (args, fmt);
+	vmessage (NULL, fmt, args);
+	va_end (args);
 }
 
-static void next_page (FILE *bitmapf, int page)
+static void rt_flush (void)
 {
-	/* we can't use fseek here because it may come from a pipe! */
-	int skip;
-	skip = (bmheight - topskip - linecnt) * bmwidth;
-	message ("bmheight = %d, bmwidth = %d, leftskip = %d, "
-		 "topskip = %d, linecnt = %d, skip = %d\n",
-		 bmheight, bmwidth, leftskip, topskip, linecnt, skip);
-	if (skip > 0)
-		bitmap_seek (bitmapf, skip);
-	linecnt = 0;
+	fwrite (rt_log, 1, rt_loglen, stderr);
+	if (rt_logdrop)
+		fprintf (stderr, "(%d messages dropped)\n", rt_logdrop);
+	rt_loglen = 0;
+	rt_logdrop = 0;
+}
+
+
+static long elapsed (struct timeval *from)
+{
+	struct timeval now;
+	gettimeofday (&now, NULL);
+	return (now.tv_usec - from->tv_usec)
+		+ ((now.tv_sec - from->tv_sec) * 1000000);
 }
 
-static void out_packet (int rle, unsigned char a, unsigned char b, unsigned char c)
+/* Input buffer of the bitmap readers. The ASCII and PAM parsers look
+ * ahead in it, so the binary rows are read through it as well.
+ */
+static struct
+{
+	FILE *f;
+	int pos;
+	int len;
+	unsigned char buf[65536];
+} in;
+
+/* Returns the number of bytes available, 0 at the end of the file */
+static int in_fill (FILE *f)
 {
-	static unsigned char parity[] =
+	if (in.f != f)
 	{
-		0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
-		1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
-		1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
-		0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0
-	};
+		in.f = f;
+		in.pos = in.len = 0;
+	}
+	if (in.pos < in.len)
+		return in.len - in.pos;
+	in.pos = 0;
+	in.len = fread (in.buf, 1, sizeof (in.buf), f);
+	return in.len;
+}
 
-	union pkt1 pk1;
-	union pkt2 pk2;
-	union pkt3 pk3;
-	union pkt4 pk4;
-	int tmp;
+static INLINE int in_getc (FILE *f)
+{
+	if ((in.pos >= in.len) && !in_fill (f))
+		return EOF;
+	return in.buf[in.pos++];
+}
 
-	if (rle == 2)
-	{ // flush packet storage
-		if (a == 1)
-		{ // truncated band
-			tmp = csize | 0x10000;
-			fwrite (&tmp, 1, sizeof (int), cbmf);
-		} else {
-			fwrite (&csize, 1, sizeof (int), cbmf);
-		}
+/* Reads n bytes to dst, or skips them if dst is NULL */
+static int in_read (FILE *f, unsigned char *dst, int n)
+{
+	int got = 0;
+	int len;
 
-		fwrite (cbm, csize, 4, cbmf);
-		cbmp = cbm;
-		csize = 0;
-		return;
+	while ((got < n) && (len = in_fill (f)))
+	{
+		if (len > n - got)
+			len = n - got;
+		if (dst)
+			memcpy (dst + got, in.buf + in.pos, len);
+		in.pos += len;
+		got += len;
 	}
+	return got;
+}
 
-	pk1.bits.t = 0;
-	pk2.bits.t = 1;
-	pk3.bits.t = 0;
-	pk4.bits.t = 1;
-	pk1.bits.rle = rle;
-	pk1.bits.al = a & 0x3f;
-	pk2.bits.ah = (a >> 6) & 0x3;
-	pk2.bits.bl = b & 0xf;
-	pk3.bits.bh = (b >> 4) & 0xf;
-	pk3.bits.cl = c & 0x3;
-	pk4.bits.ch = (c >> 2) & 0x3f;
-	pk2.bits.pa = parity[pk2.c & 0x3f];
-	pk3.bits.pa = parity[pk3.c & 0x3f] ^ 1;
-	pk4.bits.pa = parity[pk4.c & 0x3f];
-	cbmp += sprintf (cbmp, "%c%c%c%c", pk1.c, pk2.c, pk3.c, pk4.c);
-	csize++;
-	pktcnt++;
-
-	if (csize == MAX_PACKET_COUNT)
-		out_packet (2, 1, 0, 0);
+static void bitmap_seek (FILE *bitmapf, int offset)
+{
+	in_read (bitmapf, NULL, offset);
 }
 
-static int compress_bitmap (FILE *bitmapf)
+/* Next header token. Comments may come between any two of them. */
+static int pnm_token (FILE *f, char *tok, int size)
 {
-	int band;
-	unsigned char c1, c2, c3;
-	int cnt;			/* count of characters processed in a band */
-	int pcnt;			/* count of chars for each packet */
+	int n = 0;
+	int c;
 
-	if (fgets (cbm, 200, bitmapf) <= 0)
+	do
+	{
+		c = in_getc (f);
+		if (c == '#')
+			while ((c != '\n') && (c != EOF))
+				c = in_getc (f);
+	} while ((c == ' ') || (c == '\t') || (c == '\r') || (c == '\n'));
+	if (c == EOF)
 		return 0;
-
-	if (strncmp (cbm, "P4", 2))
+	while ((c != EOF) && (c != ' ') && (c != '\t') && (c != '\r')
+	       && (c != '\n') && (c != '#'))
 	{
-		message ("Wrong file format.\n");
-		message ("file position: %lx\n", ftell (bitmapf));
-		errorexit();
+		if (n < size - 1)
+			tok[n++] = c;
+		c = in_getc (f);
 	}
-	/* bypass the comment line */
-	do
-	{
-		fgets (cbm, 200, bitmapf);
-	} while (cbm[0] == '#');
-	/* read the bitmap's dimensions */
-	if (sscanf (cbm, "%d %d", &bmwidth, &bmheight) < 2)
+	/* one whitespace ends the token, a comment its whole line */
+	if (c == '#')
+		while ((c != '\n') && (c != EOF))
+			c = in_getc (f);
+	tok[n] = 0;
+	return 1;
+}
+
+static int pnm_number (FILE *f)
+{
+	char tok[16];
+	char *end;
+	long n;
+
+	if (! pnm_token (f, tok, sizeof (tok))
+	    || ((n = strtol (tok, &end, 10)), *end) || (n < 0) || (n > 1000000))
 	{
 		message ("Bitmap file with wrong size fields.\n");
 		errorexit();
 	}
-	bmwidth = (bmwidth + 7) / 8;
-	/* adjust top and left margins */
-	if (topskip) /* we can't do seek from a pipe */
-		bitmap_seek (bitmapf, bmwidth * topskip);
+	return n;
+}
 
-	bmcnt = 0; /* Needed, otherwise corrupt all but first page */
+static int pam_header (FILE *bitmapf)
+{
+	char tok[32];
+	int maxval = 0;
 
-	/* now we process the real data */
-	for (band = 0; linecnt < lines_by_page; band++)
+	bmpixels = bmheight = 0;
+	pam_depth = 0;
+	while (1)
 	{
-		pktcnt = 0;
-		/* setup packet size */
-		if (((lines_by_page - linecnt) > ROWS_BY_BAND))
-			cnt = LINE_SIZE * ROWS_BY_BAND;
+		if (! pnm_token (bitmapf, tok, sizeof (tok)))
+			return 0;
+		if (!strcmp (tok, "ENDHDR"))
+			break;
+		if (!strcmp (tok, "WIDTH"))
+			bmpixels = pnm_number (bitmapf);
+		else if (!strcmp (tok, "HEIGHT"))
+			bmheight = pnm_number (bitmapf);
+		else if (!strcmp (tok, "DEPTH"))
+			pam_depth = pnm_number (bitmapf);
+		else if (!strcmp (tok, "MAXVAL"))
+			maxval = pnm_number (bitmapf);
+		else if (!strcmp (tok, "TUPLTYPE"))
+			pnm_token (bitmapf, tok, sizeof (tok));
 		else
-			cnt = LINE_SIZE * (lines_by_page - linecnt);
-
-		message ("cnt: %d, band: %d, linecnt: %d\n", cnt, band, linecnt);
-		c1 = get_bitmap (bitmapf);
-		c2 = get_bitmap (bitmapf);
-		cnt -= 2;
-		pcnt = 1;
-
-		while (cnt)
 		{
-			if ((c1 == c2) && (cnt > 2))
-			{
-				pcnt++;
-				c2 = get_bitmap (bitmapf);
-				cnt--;
-				continue;
-			}
-			if (cnt==2)
-			{
-				/* leave at least 2 bytes */
-				while (pcnt > 258)
-				{
-					out_packet (1, 255, c1, c1);
-					pcnt -= 257;
-				}
-				/* one more if too large for one packet */
-				if (pcnt > 256)
-				{
-					out_packet (1, 253, c1, c1);
-					pcnt -= 255;
-				}
-				out_packet (1, (pcnt - 1), c1, c2);
-				break;
-			}
-			if ((cnt == 3) || (cnt == 4))
-			{
-				if (pcnt > 1)
-				{
-					while (pcnt > 259)
-					{
-						out_packet (1, 255, c1, c1);
-						pcnt -= 257;
-					}
-					if (pcnt > 257)
-					{
-						out_packet (1, 253, c1, c1);
-						pcnt -= 255;
-					}
-					out_packet (1, (pcnt - 2), c1, c1);
-					c3 = get_bitmap (bitmapf);
-					if (cnt == 3)
-					{
-						out_packet (1, 0, c2, c3);
-					} else {
-						c1 = get_bitmap (bitmapf);
-						out_packet (0, c2, c3, c1);
-					}
-				} else {
-					c3 = get_bitmap (bitmapf);
-					if (cnt == 3)
-					{
-						out_packet (0, c1, c2, c3);
-					} else {
-						out_packet (1, 0, c1, c2);
-						c1 = get_bitmap (bitmapf);
-						out_packet (1, 0, c3, c1);
-					}
-				}
-				break;
-			}
-			if (pcnt>1)
-			{
-				while (pcnt > 258)
-				{
-					out_packet (1, 255, c1, c1);
-					pcnt -= 257;
-				}
-				if (pcnt > 256)
-				{
-					out_packet (1, 253, c1, c1);
-					pcnt -= 255;
-				}
-				out_packet (1, (pcnt - 1), c1, c2);
-				pcnt = 1;
-				c1 = get_bitmap (bitmapf);
-				c2 = get_bitmap (bitmapf);
-				cnt -= 2;
-			} else {
-				c3 = get_bitmap (bitmapf);
-				out_packet (0, c1, c2, c3);
-				c1 = get_bitmap (bitmapf);
-				c2 = get_bitmap (bitmapf);
-				cnt -= 3;
-			}
+			message ("PAM header: unknown field %s\n", tok);
+			errorexit();
 		}
-		out_packet (2, 0, 0, 0);
 	}
-	fflush (cbmf);
-	fseek (cbmf, 0, SEEK_SET);
+	/* BLACKANDWHITE or GRAYSCALE, with an optional alpha channel */
+	if ((maxval != 1) || (pam_depth < 1) || (pam_depth > 2))
+	{
+		message ("Only black and white PAM files are supported "
+			 "(maxval %d, depth %d).\n", maxval, pam_depth);
+		errorexit();
+	}
 	return 1;
 }
 
-/* End of Rildo Pragana constants and functions */
-
-void INLINE errorexit (void)
+/* Reverses the bits of a byte */
+static INLINE unsigned int rev8 (unsigned int b)
 {
-#ifdef DEBUG
-	int *i = 0;
-	(*i)++;
-#endif
-	if (cbmf)
-		fclose (cbmf);
-	exit (1);
+	return ((((b * 0x0802UL) & 0x22110UL) | ((b * 0x8020UL) & 0x88440UL))
+		* 0x10101UL >> 16) & 0xff;
 }
 
-void INLINE dataout (int data)
+/* Sets the black pixels of m, up to 16 from pixel x, the first one
+ * in bit 0. Pixels past room land in the slack of the row.
+ */
+static INLINE void put_pixels (unsigned char *row, int x, unsigned int m,
+			       int room)
 {
-	outb (data, DATA);
-}
+	unsigned int v;
 
-void INLINE ctrlout (int cmd)
-{
-	outb (cmd, CONTROL);
+	if (!m || (x >= room))
+		return;
+	v = ((rev8 (m & 0xff) << 16) | (rev8 (m >> 8) << 8)) >> (x & 7);
+	row += x / 8;
+	row[0] |= v >> 16;
+	row[1] |= v >> 8;
+	row[2] |= v;
 }
 
-int INLINE ctrlin (void)
+static INLINE void put_pixel (unsigned char *row, int x, int room)
 {
-	return inb (CONTROL);
+	if (x < room)
+		row[x / 8] |= 0x80 >> (x & 7);
 }
 
-void INLINE checkctrl (int control)
+/* ASCII row: '0' and '1' with any whitespace or comment in between.
+ * 16 characters are looked at at once, either all digits or digits
+ * alternating with whitespace, as written by pnmtoplainpnm.
+ */
+static void p1_row (FILE *f, unsigned char *row, int room)
 {
-	int ctrl = inb (CONTROL);
-	if ((ctrl & 0x1f) != (control & 0x1f))
+	int x = 0;
+	int c;
+
+	while (x < bmpixels)
 	{
-		message ("Error, wrong control : %x instead of %x\n", ctrl, control);
-		errorexit();
+#ifdef __SSE2__
+		if ((in.len - in.pos >= 16) && (bmpixels - x >= 16))
+		{
+			__m128i v = _mm_loadu_si128 ((__m128i *)(in.buf + in.pos));
+			unsigned int ones, digits, blanks, m;
+
+			ones = _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('1')));
+			digits = ones | _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('0')));
+			if (digits == 0xffff)
+			{
+				put_pixels (row, x, ones, room);
+				x += 16;
+				in.pos += 16;
+				continue;
+			}
+			blanks = _mm_movemask_epi8 (
+				_mm_or_si128 (_mm_or_si128 (
+					_mm_cmpeq_epi8 (v, _mm_set1_epi8 (' ')),
+					_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\n'))),
+					_mm_or_si128 (
+					_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\r')),
+					_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\t')))));
+			if (((digits == 0x5555) || (digits == 0xaaaa))
+			    && ((digits | blanks) == 0xffff))
+			{ /* 8 digits, keep every other bit */
+				m = (digits == 0x5555 ? ones : ones >> 1) & 0x5555;
+				m = (m | (m >> 1)) & 0x3333;
+				m = (m | (m >> 2)) & 0x0f0f;
+				m = (m | (m >> 4)) & 0x00ff;
+				put_pixels (row, x, m, room);
+				x += 8;
+				in.pos += 16;
+				continue;
+			}
+		}
+#endif
+		c = in_getc (f);
+		if (c == '1')
+			put_pixel (row, x++, room);
+		else if (c == '0')
+			x++;
+		else if (c == '#')
+		{
+			while ((c != '\n') && (c != EOF))
+				c = in_getc (f);
+		}
+		else if (c == EOF)
+			return;
+		else if ((c != ' ') && (c != '\t') && (c != '\r') && (c != '\n'))
+		{
+			message ("Bad character 0x%x in the ASCII bitmap.\n", c);
+			errorexit();
+		}
 	}
 }
 
-int INLINE statusin (void)
+/* PAM row: a byte by sample, 0 is black */
+static void pam_row (FILE *f, unsigned char *row, int room)
 {
-	return inb (STATUS);
-}
+	int x = 0;
+	int c;
 
-void INLINE checkstatus (int status)
-{
-	int stat = statusin();
-	if ((stat & 0xf8) != (status & 0xf8))
+	while (x < bmpixels)
 	{
-		message ("Error, wrong status : %x instead of %x\n", stat, status);
-		errorexit();
+#ifdef __SSE2__
+		if ((pam_depth == 1) && (in.len - in.pos >= 16)
+		    && (bmpixels - x >= 16))
+		{
+			__m128i v = _mm_loadu_si128 ((__m128i *)(in.buf + in.pos));
+
+			put_pixels (row, x, _mm_movemask_epi8 (
+					    _mm_cmpeq_epi8 (v, _mm_setzero_si128 ())),
+				    room);
+			x += 16;
+			in.pos += 16;
+			continue;
+		}
+#endif
+		if ((c = in_getc (f)) == EOF)
+			return;
+		if (c == 0)
+			put_pixel (row, x, room);
+		if (pam_depth == 2)
+			in_getc (f); /* alpha */
+		x++;
 	}
 }
 
-int INLINE cmdout (int cmd)
-{
-	int stat;
-	ctrlout (cmd);
-	usleep (1);
-	stat = statusin();
-	checkctrl (cmd);
-	return stat;
-}
-
-void INLINE checkcmdout (int cmd, int status, int mask)
+/* Reads the next row of the bitmap, up to room bytes of it, into a
+ * cleared row with 4 bytes of slack
+ */
+static void pnm_read (FILE *bitmapf, unsigned char *row, int room)
 {
-	int stat = cmdout (cmd);
-	if ((stat & mask) != (status & mask))
+	switch (bmformat)
 	{
-		message ("Error, wrong status (checkcmdout) :"
-			 " %x instead of %x (mask : %x)\n", stat, status, mask);
-		errorexit();
+	case '4':
+		if (bmwidth > room)
+		{
+			in_read (bitmapf, row, room);
+			bitmap_seek (bitmapf, bmwidth - room);
+		} else {
+			in_read (bitmapf, row, bmwidth);
+		}
+		break;
+	case '1':
+		p1_row (bitmapf, row, room * 8);
+		break;
+	case '7':
+		pam_row (bitmapf, row, room * 8);
 	}
 }
 
-int INLINE cmddataouts (int cmd, int data, int sleep)
+/* Reads the next row of the bitmap into bmbuf */
+static void pnm_row (FILE *bitmapf)
 {
-	int stat;
-	ctrlout (cmd);
-	usleep (sleep);
-	stat = statusin();
-	dataout (data);
-	checkctrl (cmd);
-	return stat;
+	memset (bmbuf, 0, sizeof (bmbuf));
+	pnm_read (bitmapf, bmbuf, 800);
 }
 
-void INLINE cmddataout (int cmd, int data)
+/* Skips rows of the bitmap */
+static void pnm_skip (FILE *bitmapf, int rows)
 {
-	cmddataouts (cmd, data, 10);
+	if (rows <= 0)
+		return;
+	if (bmformat == '4')
+		bitmap_seek (bitmapf, rows * bmwidth);
+	else
+		while (rows--)
+			pnm_row (bitmapf);
 }
 
-void INLINE checkcmddataouts (int cmd, int data, int status, int mask, int sleep)
+/* Reads the header of the next page, returns 0 at the end of the input.
+ * Binary (P4) and ASCII (P1) bitmaps, and black and white PAM (P7).
+ */
+static int pnm_header (FILE *bitmapf)
 {
-	int stat = cmddataouts (cmd, data, sleep);
-	if ((stat & mask) != (status & mask))
+	char tok[8];
+
+	if (! pnm_token (bitmapf, tok, sizeof (tok)))
+		return 0;
+
+	if (!strcmp (tok, "P4") || !strcmp (tok, "P1"))
 	{
-		message ("Error, wrong status (checkcmddataout) :"
-			 " %x instead of %x (mask : %x)\n", stat, status, mask);
+		bmpixels = pnm_number (bitmapf);
+		bmheight = pnm_number (bitmapf);
+	} else if (!strcmp (tok, "P7")) {
+		if (! pam_header (bitmapf))
+		{
+			message ("PAM header: unexpected end of file\n");
+			errorexit();
+		}
+	} else {
+		message ("Wrong file format.\n");
+		message ("file position: %lx\n", ftell (bitmapf));
 		errorexit();
 	}
+	bmformat = tok[1];
+	bmwidth = (bmpixels + 7) / 8;
+	return 1;
 }
 
-void INLINE checkcmddataout (int cmd, int data, int status, int mask)
+static int pbm_open (FILE *bitmapf)
 {
-	checkcmddataouts (cmd, data, status, mask, 15);
+	if (! pnm_header (bitmapf))
+		return 0;
+	/* adjust top and left margins */
+	pnm_skip (bitmapf, topskip); /* we can't do seek from a pipe */
+	return 1;
 }
 
-void INLINE data6out (int data)
+/* Reads the row linecnt of the page */
+static void get_row (FILE *bitmapf, unsigned char *row)
 {
-	// Must be : cmdout (2, 4[e6])
-	checkcmddataout (0x06, data, 0x70, 0x70);
-	ctrlout (0x06);
-	usleep (10);
-	checkcmdout (0x7, 0x70, 0x70);
-	checkcmdout (0x6, 0x70, 0x70);
-	ctrlout (0x06);
+	if (linecnt < (bmheight - topskip))
+		pnm_row (bitmapf);
+	else
+		memset (bmbuf, 0, sizeof (bmbuf));
+	memcpy (row, bmbuf + leftskip / 8, LINE_SIZE);
 }
 
-void INLINE data64out (int *data, int start, int end)
+static void next_page (FILE *bitmapf, int page)
 {
-	int i;
-	// Must be : cmdout (2, 4[e6])
-	checkcmddataout (0x06, data[start], 0x70, 0x70);
-	for (i = start + 1; i < end; i += 2)
-	{
-		ctrlout (0x06);
-		checkcmdout (0x07, 0x70, 0x70);
-		checkcmddataout (0x06, data[i], 0x70, 0x70);
-
-		ctrlout (0x04);
-		checkcmdout (0x05, 0x70, 0x70);
-		checkcmddataout (0x04, data[i + 1], 0x70, 0x70);
-	}
-	ctrlout (0x06);
-	checkcmdout (0x7, 0x70, 0x70);
-	checkcmdout (0x6, 0x70, 0x70);
-	ctrlout (0x06);
-}
-
-/* band : index of the band
- * size : size of the band
- * type : 0 : classic
- *        1 : truncated (never used)
- * white : should we send only a white band ?
- * timeout : should we timeout (1), or wait for paper forever (0)
+	/* we can't use fseek here because it may come from a pipe! */
+	int skip;
+	skip = (bmheight - topskip - linecnt) * bmwidth;
+	message ("bmheight = %d, bmwidth = %d, leftskip = %d, "
+		 "topskip = %d, linecnt = %d, skip = %d\n",
+		 bmheight, bmwidth, leftskip, topskip, linecnt, skip);
+	pnm_skip (bitmapf, bmheight - topskip - linecnt);
+	linecnt = 0;
+}
+
+/* Rotated bitmaps (-a). The input page is kept packed, as read, and
+ * the rotated rows are built ROWS_BY_BAND at a time, 8x8 bits blocks
+ * transposed in a 64-bit word. Angles are clockwise.
  */
-static int print_band (int band, int size, int type, int white, int timeout)
+static int rotation = 0;
+static struct
 {
-	int i;
-	unsigned char *buf;
-	int ret;
+	unsigned char *page;	/* input page, bmwidth by bmheight */
+	long size;
+	int width;		/* rotated page, in pixels */
+	int height;
+	int tile;		/* tile in buf, -1 if none */
+	unsigned char buf[ROWS_BY_BAND][800];
+} rot = { .tile = -1 };
+
+/* Transposes the 8x8 bits matrix of x, row 0 in the high byte and
+ * column 0 in the high bit of each row
+ */
+static INLINE unsigned long long transpose8 (unsigned long long x)
+{
+	unsigned long long t;
+
+	t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaULL;
+	x ^= t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000cccc0000ccccULL;
+	x ^= t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ULL;
+	x ^= t ^ (t << 28);
+	return x;
+}
 
-	buf = cbm;
-
-	message ("Initing band(%d - %d - %d - %d - %d)...\n",
-		 band, size, type, white, timeout);
-
-	if (type == 1)
-	{ // Quick init (band truncated), never used
-		checkcmddataouts (0x04, 0xff, 0x70, 0x70, 1);
-	} else { //Normal init
-		ctrlout (0x02);
-		checkctrl (0xc2);
-		checkcmddataouts (0x06, 0x80, 0x70, 0x70, 1);
-		checkcmdout (0x07, 0x70, 0x70);
-		checkcmddataouts (0x06, 0xff, 0x70, 0x70, 1);
-	}
-	ctrlout (0x04);
-	ctrlout (0x05);
-
-	message ("Waiting for ready status...\n");
-	statusin();
-	if (((ret = statusin()) & 0xf0) != 0x70)
-	{
-		struct timeval ltv; /* Begin time */
-		struct timeval itv; /* Last init time */
-		struct timeval ntv; /* Current time */
-		gettimeofday (&ltv, NULL);
-		gettimeofday (&itv, NULL);
-		do
+/* Builds the rotated rows from tile * ROWS_BY_BAND */
+static void rot_tile (int tile)
+{
+	const unsigned char *src[8];
+	unsigned long long x;
+	int y0 = tile * ROWS_BY_BAND;
+	int y1 = y0 + ROWS_BY_BAND;
+	int bytes = (rot.width + 7) / 8;
+	int pad = bmwidth * 8 - bmpixels;
+	int j0, j1;
+	int i, j, k, b, r, y;
+
+	if (y1 > rot.height)
+		y1 = rot.height;
+	if (bytes > 800)
+		bytes = 800;
+	memset (rot.buf, 0, sizeof (rot.buf));
+
+	if (rotation == 180)
+	{ /* rows backwards, bits reversed */
+		for (y = y0; y < y1; y++)
 		{
-			message ("%x ", ret);
-			usleep (1);
-			gettimeofday (&ntv, NULL);
-			if (((ntv.tv_usec - itv.tv_usec)
-			     + ((ntv.tv_sec - itv.tv_sec) * 1000000)) > 1000000)
-			{ // Reinit every second
-				message ("Reiniting band...\n");
-				statusin();
-				if (type == 1)
-				{ // Quick init (band truncated), never used
-					checkcmddataouts (0x04, 0xff, 0x70, 0x70, 1);
-				} else { //Normal init
-					ctrlout (0x02);
-					checkctrl (0xc2);
-					checkcmddataouts (0x06, 0x80, 0x70, 0x70, 1);
-					//      ctrlout (0x06);
-					checkcmdout (0x07, 0x70, 0x70);
-					checkcmddataouts (0x06, 0xff, 0x70, 0x70, 1);
-				}
-				ctrlout (0x04);
-				ctrlout (0x05);
-				gettimeofday (&itv, NULL);
-			}
-			if (((ntv.tv_usec - ltv.tv_usec)
-			     + ((ntv.tv_sec - ltv.tv_sec) * 1000000)) > 15000000)
-			{ // 15 seconds timeout
-				if (timeout)
-				{
-					message ("Band initialisation failed (0x%x)\n",
-						 statusin());
-					return 0;
-				} else {
-					message ("Waiting for paper... (0x%x)\n",
-						 statusin());
-					while (((ret = statusin()) & 0xf0) == 0xF0)
-					{
-						gettimeofday (&ntv, NULL);
-						if (((ntv.tv_usec - ltv.tv_usec)
-						     + ((ntv.tv_sec - ltv.tv_sec) * 1000000))
-						    > 1800000000)
-						{ //30 minutes timeout
-						message ("Timed out waiting for paper. (0x%x)\n",
-							 statusin());
-						return 0;
-						}
-						usleep (1);
-					}
-					timeout = 1;
-					gettimeofday (&ltv, NULL);
-				}
+			src[0] = rot.page + (long)(bmheight - 1 - y) * bmwidth;
+			for (k = 0; k < bytes; k++)
+			{
+				i = bmwidth - 1 - k;
+				r = rev8 (src[0][i]) << pad;
+				if (i > 0)
+					r |= rev8 (src[0][i - 1]) >> (8 - pad);
+				rot.buf[y - y0][k] = r;
 			}
-		} while (((ret = statusin()) & 0xf0) != 0x70);
-		message ("Band inited (0x%x, %lu)\n", statusin(),
-			 ((ntv.tv_usec - ltv.tv_usec) + ((ntv.tv_sec - ltv.tv_sec) * 1000000)));
-	} else {
-		message ("Band inited (0x%x, 0)\n", statusin());
+		}
+		rot.tile = tile;
+		return;
 	}
 
-	/* data */
-
-	if (white)
+	/* input columns of the tile, 90: y, 270: bmpixels - 1 - y */
+	if (rotation == 90)
+	{
+		j0 = y0 / 8;
+		j1 = (y1 - 1) / 8;
+	} else {
+		j0 = (bmpixels - y1) / 8;
+		j1 = (bmpixels - 1 - y0) / 8;
+	}
+	for (k = 0; k < bytes; k++)
 	{
-		for (i = 0; i < 242; i++)
+		/* input rows of the 8 pixels, 90: bottom up, 270: top down */
+		for (b = 0; b < 8; b++)
 		{
-			dataout (0x7f);
-			dataout (0x83);
-			dataout (0x40);
-			dataout (0x80);
+			r = (rotation == 90) ? bmheight - 1 - (8 * k + b) : 8 * k + b;
+			src[b] = ((r >= 0) && (r < bmheight))
+				? rot.page + (long)r * bmwidth : NULL;
 		}
-		dataout (0x4d);
-		dataout (0x83);
-		dataout (0x40);
-	} else {
-		for (i = 0; i < size; i++)
+		for (j = j0; j <= j1; j++)
 		{
-			dataout (*buf++);
-			dataout (*buf++);
-			dataout (*buf++);
-			dataout (*buf++);
+			x = 0;
+			for (b = 0; b < 8; b++)
+				x = (x << 8) | (src[b] ? src[b][j] : 0);
+			if (!x)
+				continue;
+			x = transpose8 (x);
+			for (i = 0; i < 8; i++)
+			{
+				y = (rotation == 90) ? 8 * j + i
+					: bmpixels - 1 - (8 * j + i);
+				if ((y >= y0) && (y < y1))
+					rot.buf[y - y0][k] = x >> (56 - 8 * i);
+			}
 		}
 	}
-
-	checkctrl (0xc5);
-	checkcmddataouts (0x04, 0x89, 0x70, 0x70, 3000);
-	ctrlout (0x06);
-	checkcmdout (0x07, 0x70, 0x70);
-	checkcmdout (0x06, 0x70, 0x70);
-	ctrlout (0x06);
-
-	return ret;
+	rot.tile = tile;
 }
 
-static void reset_printer (struct printer *prt)
+static int rot_open (FILE *bitmapf)
 {
-	int i = 0;
-	int sig = 0;
-	int ret = 0;
-	int offset = 0;
+	long size;
+	int r;
 
-	message ("Resetting %s...", prt->name);
-	
-	dataout (0x24);
-	dataout (0x06);
-	usleep (100);
-	
-	ctrlout (0x0a);
-	ctrlout (0x0a);
-	ctrlout (0x0e);
-	usleep (1000000); //16
-	
-	dataout (0x24);
-	checkctrl (0xce);
-	ctrlout (0x06);
-	usleep (150); /* 100-250 */
+	if (! pnm_header (bitmapf))
+		return 0;
 
+	size = (long)bmwidth * bmheight + 4;
+	if (size > rot.size)
 	{
-		int stat = statusin();
-
-		switch (stat /*& 0xf8*/)
+		free (rot.page);
+		if (! (rot.page = malloc (size)))
 		{
-			case 0x3e:
-				printf ("ok\n");
-				break;
-			case 0x5e:
-				printf ("failed, check cables\n");
-				errorexit();
-			default:
-				printf ("failed, error code 0x%x\n", stat);
-				errorexit();
+			message ("Not enough memory to rotate the page\n");
+			errorexit();
 		}
+		rot.size = size;
 	}
+	memset (rot.page, 0, size);
+	for (r = 0; r < bmheight; r++)
+		pnm_read (bitmapf, rot.page + (long)r * bmwidth, bmwidth);
 
-	checkctrl (0xc6);
-	ctrlout (0x07);
-	ctrlout (0x07);
-	ctrlout (0x04);
-	usleep (40);
-	
-	checkstatus (0xde);
-	checkctrl (0xc4);
-	ctrlout (0x06);
-	usleep (40);
-	
-	checkstatus (0xfe);
-	usleep (10);
-	
-	checkctrl (0xc6);
-	ctrlout (0x06);
-	sig = 0; /* true if a 5e has been received */
-	i = 0; /* 0e - 4e count */
-	while (1)
+	if (rotation == 180)
 	{
-		ret = cmdout(0x02) & 0xf8;
-		if (ret == 0x08)
-		{
-			i++;
-		} else if (ret == 0x18) {
-			i = 0;
-		} else {
-			message ("Error, wrong status (init 2nd loop) :"
-				 " %x instead of 0x[01]8\n", ret);
-			errorexit();
-		}
+		rot.width = bmpixels;
+		rot.height = bmheight;
+	} else {
+		rot.width = bmheight;
+		rot.height = bmpixels;
+	}
+	rot.tile = -1;
+	return 1;
+}
 
-		if (sig && (i == 21))
-			break;
+/* Reads the row linecnt of the rotated page */
+static void rot_row (FILE *bitmapf, unsigned char *row)
+{
+	int y = topskip + linecnt;
 
-		ret = cmdout(0x00) & 0xf8;
-		if (ret == 0x48)
-		{
-			i++;
-		} else if (ret == 0x58) {
-			i = 0;
-			sig = 1;
-		} else {
-			message ("Error, wrong status (init 2nd loop) :"
-				 " %x instead of 0x[45]8\n", ret);
-			errorexit();
-		}
+	if (y >= rot.height)
+	{
+		memset (row, 0, LINE_SIZE);
+		return;
 	}
+	if (y / ROWS_BY_BAND != rot.tile)
+		rot_tile (y / ROWS_BY_BAND);
+	memcpy (row, rot.buf[y % ROWS_BY_BAND] + leftskip / 8, LINE_SIZE);
+}
 
-	checkcmdout (0x06, 0x78, 0x78);
-	ctrlout (0x04);
-	checkcmdout (0x0c, 0x28, 0x78);
-	ctrlout (0x0c);
-	usleep (15);
-	
-	dataout (0x20);
-	checkctrl (0xcc);
-	checkcmdout (0x06, 0x38, 0x78);
-	ctrlout (0x07);
-	ctrlout (0x07);
-	ctrlout (0x04);
-	usleep (40);
-	
-	checkstatus (0xde);
-	checkctrl (0xc4);
-	ctrlout (0x06);
-	usleep (40);
-	
-	checkstatus (0xfe);
-	sleep (2);
-
-	for (i = 0; i < 12287; i++)
-		dataout (0);
+static void rot_next (FILE *bitmapf, int page)
+{
+	linecnt = 0; /* the page was read by rot_open() */
+}
 
-	usleep (500);
-	
-	checkstatus (0xfe);
-	dataout (0xa0);
-	checkctrl (0xc6);
-	ctrlout (0x06);
-	checkcmdout (0x07, 0x78, 0x78);
-	ctrlout (0x06);
-	usleep (10);
-	
-	checkstatus (0xfe);
-	dataout (0x00);
-	checkctrl (0xc6);
-	ctrlout (0x04);
-	checkcmdout (0x05, 0x78, 0x78);
-	ctrlout (0x04);
-	usleep (20);
-	
-	checkstatus (0xfe);
-	dataout (0xa0);
-	checkctrl (0xc4);
-	ctrlout (0x06);
-	checkcmdout (0x07, 0x78, 0x78);
-	checkcmdout (0x06, 0x78, 0x78);
-	ctrlout (0x06);
-	offset = 0;
+/* N-up imposition (-N 2 or 4). The input pages are halved both ways,
+ * a pixel being black if any of its 2x2 input pixels is, and laid out
+ * by two across the sheet: 4-up fills both halves of it, 2-up its
+ * middle. The left page of a pair is halved into a buffer first, the
+ * right one as its rows are read.
+ */
+static int nup = 0;
+static struct
+{
+	int top;	/* first row of the pages on the sheet */
+	int height;	/* rows of a halved page */
+	int left;	/* the left page is in buf */
+	int right;	/* the right page is open */
+	int rows;	/* rows read of the open page */
+	unsigned char in[LINE_SIZE];
+	unsigned char buf[LINES_BY_PAGE660 / 2][LINE_SIZE / 2];
+} nupst;
+
+/* Each byte halved to a nibble, then two nibbles to a byte, in the low
+ * byte of every 16 bits
+ */
+static INLINE unsigned long long half_bits (unsigned long long x)
+{
+	x = (x | (x << 1)) & 0xaaaaaaaaaaaaaaaaULL;
+	x >>= 1;
+	x = (x | (x >> 1)) & 0x3333333333333333ULL;
+	x = (x | (x >> 2)) & 0x0f0f0f0f0f0f0f0fULL;
+	return ((x << 4) | (x >> 8)) & 0x00ff00ff00ff00ffULL;
+}
+
+/* Halves the rows a and b, LINE_SIZE bytes, into LINE_SIZE / 2 bytes */
+static void box_half (const unsigned char *a, const unsigned char *b,
+		      unsigned char *out)
+{
+	unsigned long long x, y;
+	int i = 0;
+#ifdef __SSE2__
+	const __m128i odd = _mm_set1_epi8 (0xaa);
+	const __m128i m2 = _mm_set1_epi8 (0x33);
+	const __m128i m4 = _mm_set1_epi8 (0x0f);
+	const __m128i lo = _mm_set1_epi16 (0x00ff);
+	__m128i v[2];
+	int k;
+
+	for (; i + 32 <= LINE_SIZE; i += 32)
+	{
+		for (k = 0; k < 2; k++)
+		{
+			__m128i w = _mm_or_si128 (
+				_mm_loadu_si128 ((const __m128i *)(a + i + 16 * k)),
+				_mm_loadu_si128 ((const __m128i *)(b + i + 16 * k)));
+			w = _mm_and_si128 (_mm_or_si128 (w, _mm_slli_epi64 (w, 1)), odd);
+			w = _mm_srli_epi64 (w, 1);
+			w = _mm_and_si128 (_mm_or_si128 (w, _mm_srli_epi64 (w, 1)), m2);
+			w = _mm_and_si128 (_mm_or_si128 (w, _mm_srli_epi64 (w, 2)), m4);
+			v[k] = _mm_and_si128 (_mm_or_si128 (_mm_slli_epi16 (w, 4),
+							    _mm_srli_epi16 (w, 8)), lo);
+		}
+		_mm_storeu_si128 ((__m128i *)(out + i / 2),
+				  _mm_packus_epi16 (v[0], v[1]));
+	}
+#endif
+	for (; i < LINE_SIZE; i += 8)
+	{
+		memcpy (&x, a + i, 8);
+		memcpy (&y, b + i, 8);
+		x = half_bits (x | y);
+		out[i / 2] = x;
+		out[i / 2 + 1] = x >> 16;
+		out[i / 2 + 2] = x >> 32;
+		out[i / 2 + 3] = x >> 48;
+	}
+}
+
+/* Halves the next two rows of the open page into out */
+static void nup_read (FILE *bitmapf, unsigned char *out)
+{
+	int i;
+
+	for (i = 0; i < 2; i++)
+	{
+		if (nupst.rows < bmheight - topskip)
+		{
+			pnm_row (bitmapf);
+			nupst.rows++;
+		} else {
+			memset (bmbuf, 0, sizeof (bmbuf));
+		}
+		if (!i)
+			memcpy (nupst.in, bmbuf + leftskip / 8, LINE_SIZE);
+	}
+	box_half (nupst.in, bmbuf + leftskip / 8, out);
+}
+
+/* Skips what is left of the open page */
+static void nup_skip (FILE *bitmapf)
+{
+	pnm_skip (bitmapf, bmheight - topskip - nupst.rows);
+	nupst.rows = 0;
+}
+
+/* Reads the left page of a pair, opens the right one. Returns 0 at
+ * the end of the input.
+ */
+static int nup_pair (FILE *bitmapf)
+{
+	int y;
+
+	if (nupst.right)
+	{
+		nup_skip (bitmapf);
+		nupst.right = 0;
+	}
+	memset (nupst.buf, 0, sizeof (nupst.buf));
+	if (! (nupst.left = pbm_open (bitmapf)))
+		return 0;
+	nupst.rows = 0;
+	for (y = 0; y < nupst.height; y++)
+		nup_read (bitmapf, nupst.buf[y]);
+	nup_skip (bitmapf);
+	nupst.right = pbm_open (bitmapf);
+	return 1;
+}
+
+static int nup_open (FILE *bitmapf)
+{
+	nupst.height = lines_by_page / 2;
+	nupst.top = (nup == 4) ? 0 : (lines_by_page - nupst.height) / 2;
+	return nup_pair (bitmapf);
+}
+
+static void nup_row (FILE *bitmapf, unsigned char *row)
+{
+	int y = linecnt - nupst.top;
+
+	memset (row, 0, LINE_SIZE);
+	if ((y < 0) || (y >= nupst.height * (nup / 2)))
+		return;
+	if (y == nupst.height)
+		nup_pair (bitmapf); /* the bottom pair of 4-up */
+	y %= nupst.height;
+	if (nupst.left)
+		memcpy (row, nupst.buf[y], LINE_SIZE / 2);
+	if (nupst.right)
+		nup_read (bitmapf, row + LINE_SIZE / 2);
+}
+
+static void nup_next (FILE *bitmapf, int page)
+{
+	if (nupst.right)
+	{
+		nup_skip (bitmapf);
+		nupst.right = 0;
+	}
+	linecnt = 0;
+}
+
+/* Plain text input (-T). Lines of up to TEXT_COLUMNS characters of a
+ * 5x7 font, drawn in a cell of 6x8 dots scaled to 10 cpi and 6 lpi. A
+ * form feed or the end of the file ends the page, longer lines wrap.
+ */
+static const unsigned char font[95][5] =
+{
+	{ 0x00, 0x00, 0x00, 0x00, 0x00 }, /*   */
+	{ 0x00, 0x00, 0x5f, 0x00, 0x00 }, /* ! */
+	{ 0x00, 0x07, 0x00, 0x07, 0x00 }, /* " */
+	{ 0x14, 0x7f, 0x14, 0x7f, 0x14 }, /* # */
+	{ 0x24, 0x2a, 0x7f, 0x2a, 0x12 }, /* $ */
+	{ 0x23, 0x13, 0x08, 0x64, 0x62 }, /* % */
+	{ 0x36, 0x49, 0x55, 0x22, 0x50 }, /* & */
+	{ 0x00, 0x05, 0x03, 0x00, 0x00 }, /* ' */
+	{ 0x00, 0x1c, 0x22, 0x41, 0x00 }, /* ( */
+	{ 0x00, 0x41, 0x22, 0x1c, 0x00 }, /* ) */
+	{ 0x08, 0x2a, 0x1c, 0x2a, 0x08 }, /* * */
+	{ 0x08, 0x08, 0x3e, 0x08, 0x08 }, /* + */
+	{ 0x00, 0x50, 0x30, 0x00, 0x00 }, /* , */
+	{ 0x08, 0x08, 0x08, 0x08, 0x08 }, /* - */
+	{ 0x00, 0x60, 0x60, 0x00, 0x00 }, /* . */
+	{ 0x20, 0x10, 0x08, 0x04, 0x02 }, /* / */
+	{ 0x3e, 0x51, 0x49, 0x45, 0x3e }, /* 0 */
+	{ 0x00, 0x42, 0x7f, 0x40, 0x00 }, /* 1 */
+	{ 0x42, 0x61, 0x51, 0x49, 0x46 }, /* 2 */
+	{ 0x21, 0x41, 0x45, 0x4b, 0x31 }, /* 3 */
+	{ 0x18, 0x14, 0x12, 0x7f, 0x10 }, /* 4 */
+	{ 0x27, 0x45, 0x45, 0x45, 0x39 }, /* 5 */
+	{ 0x3c, 0x4a, 0x49, 0x49, 0x30 }, /* 6 */
+	{ 0x01, 0x71, 0x09, 0x05, 0x03 }, /* 7 */
+	{ 0x36, 0x49, 0x49, 0x49, 0x36 }, /* 8 */
+	{ 0x06, 0x49, 0x49, 0x29, 0x1e }, /* 9 */
+	{ 0x00, 0x36, 0x36, 0x00, 0x00 }, /* : */
+	{ 0x00, 0x56, 0x36, 0x00, 0x00 }, /* ; */
+	{ 0x08, 0x14, 0x22, 0x41, 0x00 }, /* < */
+	{ 0x14, 0x14, 0x14, 0x14, 0x14 }, /* = */
+	{ 0x00, 0x41, 0x22, 0x14, 0x08 }, /* > */
+	{ 0x02, 0x01, 0x51, 0x09, 0x06 }, /* ? */
+	{ 0x32, 0x49, 0x79, 0x41, 0x3e }, /* @ */
+	{ 0x7e, 0x11, 0x11, 0x11, 0x7e }, /* A */
+	{ 0x7f, 0x49, 0x49, 0x49, 0x36 }, /* B */
+	{ 0x3e, 0x41, 0x41, 0x41, 0x22 }, /* C */
+	{ 0x7f, 0x41, 0x41, 0x22, 0x1c }, /* D */
+	{ 0x7f, 0x49, 0x49, 0x49, 0x41 }, /* E */
+	{ 0x7f, 0x09, 0x09, 0x09, 0x01 }, /* F */
+	{ 0x3e, 0x41, 0x49, 0x49, 0x7a }, /* G */
+	{ 0x7f, 0x08, 0x08, 0x08, 0x7f }, /* H */
+	{ 0x00, 0x41, 0x7f, 0x41, 0x00 }, /* I */
+	{ 0x20, 0x40, 0x41, 0x3f, 0x01 }, /* J */
+	{ 0x7f, 0x08, 0x14, 0x22, 0x41 }, /* K */
+	{ 0x7f, 0x40, 0x40, 0x40, 0x40 }, /* L */
+	{ 0x7f, 0x02, 0x0c, 0x02, 0x7f }, /* M */
+	{ 0x7f, 0x04, 0x08, 0x10, 0x7f }, /* N */
+	{ 0x3e, 0x41, 0x41, 0x41, 0x3e }, /* O */
+	{ 0x7f, 0x09, 0x09, 0x09, 0x06 }, /* P */
+	{ 0x3e, 0x41, 0x51, 0x21, 0x5e }, /* Q */
+	{ 0x7f, 0x09, 0x19, 0x29, 0x46 }, /* R */
+	{ 0x46, 0x49, 0x49, 0x49, 0x31 }, /* S */
+	{ 0x01, 0x01, 0x7f, 0x01, 0x01 }, /* T */
+	{ 0x3f, 0x40, 0x40, 0x40, 0x3f }, /* U */
+	{ 0x1f, 0x20, 0x40, 0x20, 0x1f }, /* V */
+	{ 0x3f, 0x40, 0x38, 0x40, 0x3f }, /* W */
+	{ 0x63, 0x14, 0x08, 0x14, 0x63 }, /* X */
+	{ 0x07, 0x08, 0x70, 0x08, 0x07 }, /* Y */
+	{ 0x61, 0x51, 0x49, 0x45, 0x43 }, /* Z */
+	{ 0x00, 0x7f, 0x41, 0x41, 0x00 }, /* [ */
+	{ 0x02, 0x04, 0x08, 0x10, 0x20 }, /* \ */
+	{ 0x00, 0x41, 0x41, 0x7f, 0x00 }, /* ] */
+	{ 0x04, 0x02, 0x01, 0x02, 0x04 }, /* ^ */
+	{ 0x40, 0x40, 0x40, 0x40, 0x40 }, /* _ */
+	{ 0x00, 0x01, 0x02, 0x04, 0x00 }, /* ` */
+	{ 0x20, 0x54, 0x54, 0x54, 0x78 }, /* a */
+	{ 0x7f, 0x48, 0x44, 0x44, 0x38 }, /* b */
+	{ 0x38, 0x44, 0x44, 0x44, 0x20 }, /* c */
+	{ 0x38, 0x44, 0x44, 0x48, 0x7f }, /* d */
+	{ 0x38, 0x54, 0x54, 0x54, 0x18 }, /* e */
+	{ 0x08, 0x7e, 0x09, 0x01, 0x02 }, /* f */
+	{ 0x0c, 0x52, 0x52, 0x52, 0x3e }, /* g */
+	{ 0x7f, 0x08, 0x04, 0x04, 0x78 }, /* h */
+	{ 0x00, 0x44, 0x7d, 0x40, 0x00 }, /* i */
+	{ 0x20, 0x40, 0x44, 0x3d, 0x00 }, /* j */
+	{ 0x7f, 0x10, 0x28, 0x44, 0x00 }, /* k */
+	{ 0x00, 0x41, 0x7f, 0x40, 0x00 }, /* l */
+	{ 0x7c, 0x04, 0x18, 0x04, 0x78 }, /* m */
+	{ 0x7c, 0x08, 0x04, 0x04, 0x78 }, /* n */
+	{ 0x38, 0x44, 0x44, 0x44, 0x38 }, /* o */
+	{ 0x7c, 0x14, 0x14, 0x14, 0x08 }, /* p */
+	{ 0x08, 0x14, 0x14, 0x18, 0x7c }, /* q */
+	{ 0x7c, 0x08, 0x04, 0x04, 0x08 }, /* r */
+	{ 0x48, 0x54, 0x54, 0x54, 0x20 }, /* s */
+	{ 0x04, 0x3f, 0x44, 0x40, 0x20 }, /* t */
+	{ 0x3c, 0x40, 0x40, 0x20, 0x7c }, /* u */
+	{ 0x1c, 0x20, 0x40, 0x20, 0x1c }, /* v */
+	{ 0x3c, 0x40, 0x30, 0x40, 0x3c }, /* w */
+	{ 0x44, 0x28, 0x10, 0x28, 0x44 }, /* x */
+	{ 0x0c, 0x50, 0x50, 0x50, 0x3c }, /* y */
+	{ 0x44, 0x64, 0x54, 0x4c, 0x44 }, /* z */
+	{ 0x00, 0x08, 0x36, 0x41, 0x00 }, /* { */
+	{ 0x00, 0x00, 0x7f, 0x00, 0x00 }, /* | */
+	{ 0x00, 0x41, 0x36, 0x08, 0x00 }, /* } */
+	{ 0x08, 0x04, 0x08, 0x10, 0x08 }, /* ~ */
+};
+
+static unsigned char text_glyphs[7][LINE_SIZE]; /* the current line */
+static int text_blank = 1;	/* nothing to draw on the current line */
+static int text_eop = 1;	/* form feed or end of file seen */
+static int text_scale;		/* rows by dot */
+
+/* Sets the dots x to x + TEXT_DOT - 1 of row */
+static void text_dot (unsigned char *row, int x)
+{
+	int end = x + TEXT_DOT;
+	for (; (x < end) && (x & 7); x++)
+		row[x / 8] |= 0x80 >> (x & 7);
+	for (; x + 8 <= end; x += 8)
+		row[x / 8] = 0xff;
+	for (; x < end; x++)
+		row[x / 8] |= 0x80 >> (x & 7);
+}
+
+static void text_char (int col, int c)
+{
+	const unsigned char *glyph;
+	int x, y;
+
+	if ((c < 32) || (c > 126))
+		c = '?';
+	glyph = font[c - 32];
+	for (x = 0; x < 5; x++)
+		for (y = 0; y < 7; y++)
+			if (glyph[x] & (1 << y))
+				text_dot (text_glyphs[y], (col * 6 + x) * TEXT_DOT);
+}
+
+/* Draws the next line of text, if it fits in the page */
+static void text_line (FILE *textf)
+{
+	int col = 0;
+	int c;
+
+	text_blank = 1;
+	if (text_eop || (linecnt + 8 * text_scale > lines_by_page))
+		return;
+	memset (text_glyphs, 0, sizeof (text_glyphs));
+	text_blank = 0;
+	while (col < TEXT_COLUMNS)
+	{
+		c = getc (textf);
+		if ((c == '\n') || (c == EOF) || (c == '\f'))
+		{
+			text_eop = (c != '\n');
+			return;
+		}
+		if (c == '\t')
+			col = (col / 8 + 1) * 8;
+		else if (c != '\r')
+		{
+			if (c != ' ')
+				text_char (col, c);
+			col++;
+		}
+	}
+	/* wrapped, unless the line ends here anyway */
+	if (((c = getc (textf)) != '\n') && (c != EOF))
+		ungetc (c, textf);
+}
+
+static int text_open (FILE *textf)
+{
+	int c = getc (textf);
+
+	if (!text_eop && (c == '\f')) /* the last page was full anyway */
+		c = getc (textf);
+	if (c == EOF)
+		return 0;
+	ungetc (c, textf);
+	text_eop = 0;
+	text_scale = 12 * lines_by_page / LINES_BY_PAGE660;
+	return 1;
+}
+
+static void text_row (FILE *textf, unsigned char *row)
+{
+	int y = linecnt % (8 * text_scale);
+
+	if (y == 0)
+		text_line (textf);
+	y /= text_scale;
+	if (text_blank || (y >= 7))
+		memset (row, 0, LINE_SIZE);
+	else
+		memcpy (row, text_glyphs[y], LINE_SIZE);
+}
+
+static void text_next (FILE *textf, int page)
+{
+	linecnt = 0;
+}
+
+/* Input formats, giving the rows of each page */
+struct source
+{
+	int (*open) (FILE *f);	/* returns 0 at the end of the input */
+	void (*row) (FILE *f, unsigned char *row);
+	void (*next) (FILE *f, int page);	/* skips what is left of the page */
+};
+
+static struct source pbm_source =
+{
+	.open = pbm_open,
+	.row = get_row,
+	.next = next_page,
+};
+
+static struct source rot_source =
+{
+	.open = rot_open,
+	.row = rot_row,
+	.next = rot_next,
+};
+
+static struct source nup_source =
+{
+	.open = nup_open,
+	.row = nup_row,
+	.next = nup_next,
+};
+
+static struct source text_source =
+{
+	.open = text_open,
+	.row = text_row,
+	.next = text_next,
+};
+
+static struct source *source = &pbm_source;
+
+/* Encoder sink, appends a chunk to cbmf. The size word is little
+ * endian, as in job files.
+ */
+static int cbmf_flush (void *arg, const unsigned char *pkts, int count,
+		       int truncated)
+{
+	int size = count | (truncated ? 0x10000 : 0);
+	unsigned char w[4];
+
+	w[0] = size & 0xff;
+	w[1] = (size >> 8) & 0xff;
+	w[2] = (size >> 16) & 0xff;
+	w[3] = (size >> 24) & 0xff;
+	cpage.chunks++;
+	if ((fwrite (w, 1, 4, cbmf) != 4)
+	    || (fwrite (pkts, 4, count, cbmf) != count))
+		return -1;
+	return 0;
+}
+
+static void rewind_page (void)
+{
+	fseek (cbmf, cpage.start, SEEK_SET);
+	cpage.next = 0;
+}
+
+/* Reads the size word of the next chunk, returns 0 at the end of the page */
+static int read_chunk (int *size)
+{
+	unsigned char w[4];
+
+	if ((cpage.next >= cpage.chunks)
+	    || (fread (w, 1, 4, cbmf) != 4))
+		return 0;
+	*size = w[0] | (w[1] << 8) | (w[2] << 16) | (w[3] << 24);
+	cpage.next++;
+	return 1;
+}
+
+/* Transport source, reads the chunks of the current page */
+static int cbmf_read (void *arg, int *size, unsigned char *pkts)
+{
+	int count;
+
+	if (! read_chunk (size))
+		return 0;
+	count = *size & 0xFFFF;
+	if (count > MAX_PACKET_COUNT)
+		return -1;
+	if (!pkts)
+		return fseek (cbmf, count * 4, SEEK_CUR) ? -1 : 1;
+	return fread (pkts, 4, count, cbmf) == count ? 1 : -1;
+}
+
+static struct lbp_chunks chunks =
+{
+	.read = cbmf_read,
+};
+
+/* Black pixels of a row. The bits are summed in place (two, four,
+ * then eight at a time) and the bytes added up by psadbw, or by a
+ * multiply without SSE2.
+ */
+static INLINE int row_coverage (const unsigned char *row)
+{
+	unsigned long long v;
+	int i = 0;
+	int n = 0;
+#ifdef __SSE2__
+	const __m128i m1 = _mm_set1_epi8 (0x55);
+	const __m128i m2 = _mm_set1_epi8 (0x33);
+	const __m128i m4 = _mm_set1_epi8 (0x0f);
+	__m128i sum = _mm_setzero_si128 ();
+	__m128i x;
+
+	for (; i + 16 <= LINE_SIZE; i += 16)
+	{
+		x = _mm_loadu_si128 ((const __m128i *)(row + i));
+		x = _mm_sub_epi8 (x, _mm_and_si128 (_mm_srli_epi16 (x, 1), m1));
+		x = _mm_add_epi8 (_mm_and_si128 (x, m2),
+				  _mm_and_si128 (_mm_srli_epi16 (x, 2), m2));
+		x = _mm_and_si128 (_mm_add_epi8 (x, _mm_srli_epi16 (x, 4)), m4);
+		sum = _mm_add_epi64 (sum, _mm_sad_epu8 (x, _mm_setzero_si128 ()));
+	}
+	n = _mm_cvtsi128_si32 (sum) + _mm_cvtsi128_si32 (_mm_srli_si128 (sum, 8));
+#endif
+	for (; i < LINE_SIZE; i += 8)
+	{
+		memcpy (&v, row + i, 8);
+		v -= (v >> 1) & 0x5555555555555555ULL;
+		v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+		v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+		n += (v * 0x0101010101010101ULL) >> 56;
+	}
+	return n;
+}
+
+/* in hundredths of a percent of the page */
+static long coverage_bp (long pixels, long rows)
+{
+	return rows ? pixels * 10000 / (rows * LINE_SIZE * 8) : 0;
+}
+
+static void enc_report (const char *what, const struct enc_stat *stats)
+{
+	char buf[256];
+	int len = 0;
+	int i;
+
+	for (i = 0; i < LBP_BAND_CLASSES; i++)
+		len += snprintf (buf + len, sizeof (buf) - len, "%s %s %d (%ld MB/s)",
+				 i ? "," : "", band_class[i], stats[i].bands,
+				 stats[i].usec
+				 ? stats[i].bytes / stats[i].usec : 0);
+	message ("%s:%s\n", what, buf);
+}
+
+/* Adds the current page to the job coverage, once per sheet */
+static void cov_sheet (void)
+{
+	if (cpage.black < 0)
+	{
+		cov.unknown++;
+		return;
+	}
+	cov.job += cpage.black;
+	cov.pages++;
+}
+
+static int compress_bitmap (FILE *bitmapf)
+{
+	/* rows of the band, after the bytes left by the previous ones */
+	static unsigned char bandbuf[LINE_SIZE * (ROWS_BY_BAND + 1)];
+	static struct lbp_encoder enc;
+	int band;
+	int rows;
+	int carry = 0;
+	int pktcnt;
+	unsigned char *row;
+	long black;
+	long bp;
+	struct timeval tv;
+	int i;
+
+	if (! source->open (bitmapf))
+		return 0;
+
+	lbp_encoder_init (&enc, cbmf_flush, NULL);
+	cpage.start = ftell (cbmf);
+	cpage.chunks = 0;
+	cov.page = 0;
+	cov.band_max = 0;
+
+	/* now we process the real data, each band leaves its last 2 bytes
+	 * to the next one */
+	for (band = 0; linecnt < lines_by_page; band++)
+	{
+		rows = lines_by_page - linecnt;
+		if (rows > ROWS_BY_BAND)
+			rows = ROWS_BY_BAND;
+
+		message ("cnt: %d, band: %d, linecnt: %d\n",
+			 LINE_SIZE * rows, band, linecnt);
+		black = 0;
+		for (i = 0; i < rows; i++)
+		{
+			row = bandbuf + carry + i * LINE_SIZE;
+			source->row (bitmapf, row);
+			black += row_coverage (row);
+			if (vpage)
+				memcpy (vpage + linecnt * LINE_SIZE, row, LINE_SIZE);
+			linecnt++;
+		}
+		gettimeofday (&tv, NULL);
+		pktcnt = lbp_encode_band (&enc, bandbuf, LINE_SIZE * rows - 2);
+		if (pktcnt < 0)
+		{
+			message ("Can't write the compressed page\n");
+			errorexit();
+		}
+		enc_stats[enc.band_class].usec += elapsed (&tv);
+		enc_stats[enc.band_class].bytes += LINE_SIZE * rows - 2;
+		enc_stats[enc.band_class].bands++;
+		memmove (bandbuf, bandbuf + LINE_SIZE * rows - 2, carry + 2);
+		carry += 2;
+		TRACE3 (band_compressed, band, pktcnt, pktcnt * 4);
+
+		cov.page += black;
+		/* densest band, the last one scaled to a full band */
+		black = black * ROWS_BY_BAND / rows;
+		if (black > cov.band_max)
+			cov.band_max = black;
+	}
+	bp = coverage_bp (cov.page, lines_by_page);
+	message ("Coverage: %ld pixels, %ld.%02ld%%, densest band %ld.%02ld%%\n",
+		 cov.page, bp / 100, bp % 100,
+		 coverage_bp (cov.band_max, ROWS_BY_BAND) / 100,
+		 coverage_bp (cov.band_max, ROWS_BY_BAND) % 100);
+	cpage.black = cov.page;
+	fflush (cbmf);
+	rewind_page();
+	return 1;
+}
+
+/* End of Rildo Pragana constants and functions */
+
+/* Job files, see lbp660.h for the layout */
+
+static long job_offset = 0;	/* bytes written, or next page to read */
+static unsigned int job_version = JOB_VERSION;	/* of the job read */
+static long *job_index = NULL;	/* offset of every page */
+static int job_pages = 0;
+
+static void put_word (FILE *f, unsigned int w)
+{
+	putc (w & 0xff, f);
+	putc ((w >> 8) & 0xff, f);
+	putc ((w >> 16) & 0xff, f);
+	putc ((w >> 24) & 0xff, f);
+	job_offset += 4;
+}
+
+static void put_tag (FILE *f, const char *tag)
+{
+	fwrite (tag, 1, 4, f);
+	job_offset += 4;
+}
+
+static unsigned int get_word (FILE *f)
+{
+	unsigned char w[4];
+	if (fread (w, 1, 4, f) != 4)
+	{
+		message ("Job file: unexpected end of file\n");
+		errorexit();
+	}
+	return w[0] | (w[1] << 8) | (w[2] << 16) | ((unsigned int)w[3] << 24);
+}
+
+static void job_begin (FILE *jobf)
+{
+	put_tag (jobf, "LBPJ");
+	put_word (jobf, JOB_VERSION);
+	put_word (jobf, lines_by_page);
+	put_word (jobf, 0);
+}
+
+/* Appends the compressed page in cbmf */
+static void job_write_page (FILE *jobf)
+{
+	char buf[4096];
+	long bytes;
+	long len;
+
+	fseek (cbmf, 0, SEEK_END);
+	bytes = ftell (cbmf) - cpage.start;
+	fseek (cbmf, cpage.start, SEEK_SET);
+
+	job_index = realloc (job_index, (job_pages + 1) * sizeof (long));
+	if (!job_index)
+	{
+		message ("Not enough memory for the job index\n");
+		errorexit();
+	}
+	job_index[job_pages++] = job_offset;
+
+	put_tag (jobf, "PAGE");
+	put_word (jobf, cpage.chunks);
+	put_word (jobf, bytes);
+	put_word (jobf, cpage.black);
+	while (bytes > 0)
+	{
+		len = bytes > sizeof (buf) ? sizeof (buf) : bytes;
+		if (fread (buf, 1, len, cbmf) != len)
+		{
+			message ("Can't read back the compressed page\n");
+			errorexit();
+		}
+		fwrite (buf, 1, len, jobf);
+		job_offset += len;
+		bytes -= len;
+	}
+	rewind_page();
+}
+
+static void job_end (FILE *jobf)
+{
+	long index = job_offset;
+	int i;
+
+	put_tag (jobf, "INDX");
+	put_word (jobf, job_pages);
+	for (i = 0; i < job_pages; i++)
+	{
+		put_word (jobf, job_index[i] & 0xffffffff);
+		put_word (jobf, (job_index[i] >> 16) >> 16);
+	}
+	put_tag (jobf, "LBPE");
+	put_word (jobf, index & 0xffffffff);
+	put_word (jobf, (index >> 16) >> 16);
+	if (fflush (jobf))
+	{
+		message ("Can't write the job file\n");
+		errorexit();
+	}
+}
+
+static void job_check (FILE *jobf)
+{
+	char tag[4];
+	int lines;
+
+	if ((fread (tag, 1, 4, jobf) != 4) || memcmp (tag, "LBPJ", 4))
+	{
+		message ("Not a job file.\n");
+		errorexit();
+	}
+	job_version = get_word (jobf);
+	if ((job_version < 1) || (job_version > JOB_VERSION))
+	{
+		message ("Unsupported job file version.\n");
+		errorexit();
+	}
+	if ((lines = get_word (jobf)) != lines_by_page)
+	{
+		message ("Job file made for %d lines by page instead of %d.\n",
+			 lines, lines_by_page);
+		errorexit();
+	}
+	get_word (jobf);
+	job_offset = ftell (jobf);
+}
+
+/* Makes the next page of the job file the current compressed page,
+ * returns 0 after the last one.
+ */
+static int job_read_page (FILE *jobf)
+{
+	char tag[4];
+
+	fseek (jobf, job_offset, SEEK_SET);
+	if ((fread (tag, 1, 4, jobf) != 4) || !memcmp (tag, "INDX", 4))
+		return 0;
+	if (memcmp (tag, "PAGE", 4))
+	{
+		message ("Job file: bad page tag\n");
+		errorexit();
+	}
+	cpage.chunks = get_word (jobf);
+	job_offset = get_word (jobf);
+	cpage.black = (job_version >= 2) ? (int)get_word (jobf) : -1;
+	cpage.start = ftell (jobf);
+	cpage.next = 0;
+	job_offset += cpage.start;
+	cbmf = jobf;
+	return 1;
+}
+
+/* Makes page the next one read from the job file, using its index.
+ * Returns 0 if the job has fewer pages.
+ */
+static int job_seek (FILE *jobf, int page)
+{
+	char tag[4];
+	long index;
+	int pages;
+
+	fseek (jobf, -12, SEEK_END);
+	if ((fread (tag, 1, 4, jobf) != 4) || memcmp (tag, "LBPE", 4))
+	{
+		message ("Job file: no index\n");
+		errorexit();
+	}
+	index = get_word (jobf);
+	index |= ((long)get_word (jobf) << 16) << 16;
+	fseek (jobf, index, SEEK_SET);
+	if ((fread (tag, 1, 4, jobf) != 4) || memcmp (tag, "INDX", 4))
+	{
+		message ("Job file: bad index\n");
+		errorexit();
+	}
+	pages = get_word (jobf);
+	if (page >= pages)
+	{
+		job_offset = index;
+		return 0;
+	}
+	fseek (jobf, page * 8, SEEK_CUR);
+	job_offset = get_word (jobf);
+	job_offset |= ((long)get_word (jobf) << 16) << 16;
+	return 1;
+}
+
+/* Decodes the compressed page back and compares it with the bitmap
+ * kept in vpage. A band is made of the chunks up to the first one
+ * without the truncated flag, and carries all its rows but the last
+ * two bytes, which open the next band.
+ */
+static void verify_page (int page)
+{
+	static unsigned char band[LINE_SIZE * ROWS_BY_BAND];
+	int size;
+	int count;
+	int len = 0;
+	int got;
+	int rows;
+	int nband = 0;
+	int pos = 0;
+	struct timeval tv;
+	long t;
+
+	gettimeofday (&tv, NULL);
+	while (read_chunk (&size))
+	{
+		rows = lines_by_page - nband * ROWS_BY_BAND;
+		if (rows > ROWS_BY_BAND)
+			rows = ROWS_BY_BAND;
+		count = size & 0xFFFF;
+		if ((rows <= 0) || (count > MAX_PACKET_COUNT)
+		    || ((size & 0x10000) && (count != MAX_PACKET_COUNT))
+		    || (fread (cbm, 4, count, cbmf) != count))
+		{
+			message ("Round-trip: bad chunk in band %d (0x%x)\n",
+				 nband, size);
+			errorexit();
+		}
+		got = lbp_decode_packets (cbm, count, band + len,
+					  rows * LINE_SIZE - 2 - len);
+		if (got < 0)
+		{
+			message ("Round-trip: bad packet in band %d\n", nband);
+			errorexit();
+		}
+		len += got;
+		if (size & 0x10000)
+			continue;
+
+		if (len != rows * LINE_SIZE - 2)
+		{
+			message ("Round-trip: band %d has %d bytes instead of %d\n",
+				 nband, len, rows * LINE_SIZE - 2);
+			errorexit();
+		}
+		if (memcmp (band, vpage + pos, len))
+		{
+			message ("Round-trip: band %d differs from the bitmap\n",
+				 nband);
+			errorexit();
+		}
+		pos += len;
+		len = 0;
+		nband++;
+	}
+	if (len || (nband * ROWS_BY_BAND < lines_by_page))
+	{
+		message ("Round-trip: page %d is incomplete (%d bands)\n",
+			 page, nband);
+		errorexit();
+	}
+	rewind_page();
+
+	t = elapsed (&tv);
+	message ("Page %d verified: %d bands, %d bytes, %ld MB/s\n",
+		 page, nband, pos, t ? pos / t : 0);
+}
+
+static FILE *open_tmp (void)
+{
+	FILE *f;
+	int tfd;
+	/* temporary file to store our results */
+	char tmpname[] = "/tmp/lbp660-XXXXXX";
+	if ((tfd = mkstemp (tmpname)) < 0)
+	{
+		message ("Can't open a temporary file.\n");
+		errorexit();
+	}
+	f = fdopen (tfd, "w+");
+	unlink (tmpname);
+	return f;
+}
+
+/* Compresses the whole input into a job file */
+static void spool_job (FILE *bitmapf, FILE *jobf, int verify)
+{
+	int page;
+
+	job_begin (jobf);
+	for (page = 0;; page++)
+	{
+		cbmf = open_tmp();
+		if (! compress_bitmap (bitmapf))
+			break;
+		if (verify)
+			verify_page (page);
+		job_write_page (jobf);
+		fclose (cbmf);
+		source->next (bitmapf, page);
+	}
+	fclose (cbmf);
+	cbmf = NULL;
+	job_end (jobf);
+	message ("Spooled %d pages, %ld bytes\n", job_pages, job_offset);
+}
+
+/* Copies (-n, -C). Uncollated copies send the page again as soon as it
+ * is printed. Collated ones are printed from the pages kept by the first
+ * copy, in memory up to keep_budget bytes (-m, in MB), then in a spool
+ * file, as the chunks written by compress_bitmap(). Job files are just
+ * read again.
+ */
+static int copies = 1;
+static int collate = 0;
+static long keep_budget = 64L << 20;
+static struct
+{
+	struct kept_page
+	{
+		unsigned char *data;	/* NULL if in the spool */
+		long start;
+		long bytes;
+		long black;
+		int chunks;
+	} *pages;
+	int count;
+	long mem;	/* bytes kept in memory */
+	long spooled;
+	FILE *spool;
+} kept;
+
+/* Keeps the page in cbmf for the next copies */
+static void keep_page (void)
+{
+	struct kept_page *kp;
+	char buf[4096];
+	long bytes;
+	long len;
+
+	fseek (cbmf, 0, SEEK_END);
+	bytes = ftell (cbmf) - cpage.start;
+	fseek (cbmf, cpage.start, SEEK_SET);
+
+	kept.pages = realloc (kept.pages, (kept.count + 1) * sizeof (*kp));
+	if (!kept.pages)
+	{
+		message ("Not enough memory for the copies\n");
+		errorexit();
+	}
+	kp = kept.pages + kept.count++;
+	kp->bytes = bytes;
+	kp->chunks = cpage.chunks;
+	kp->black = cpage.black;
+	kp->data = NULL;
+
+	if ((kept.mem + bytes <= keep_budget) && (kp->data = malloc (bytes)))
+	{
+		if (fread (kp->data, 1, bytes, cbmf) != bytes)
+		{
+			message ("Can't read back the compressed page\n");
+			errorexit();
+		}
+		kept.mem += bytes;
+		rewind_page();
+		return;
+	}
+
+	if (!kept.spool)
+		kept.spool = open_tmp();
+	fseek (kept.spool, 0, SEEK_END);
+	kp->start = ftell (kept.spool);
+	kept.spooled += bytes;
+	while (bytes > 0)
+	{
+		len = bytes > sizeof (buf) ? sizeof (buf) : bytes;
+		if ((fread (buf, 1, len, cbmf) != len)
+		    || (fwrite (buf, 1, len, kept.spool) != len))
+		{
+			message ("Can't spool the compressed page\n");
+			errorexit();
+		}
+		bytes -= len;
+	}
+	rewind_page();
+}
+
+/* Makes a kept page the current one */
+static void kept_load (int page)
+{
+	struct kept_page *kp = kept.pages + page;
+
+	if (kp->data)
+	{
+		if (!(cbmf = fmemopen (kp->data, kp->bytes, "r")))
+		{
+			message ("Can't read a kept page\n");
+			errorexit();
+		}
+		cpage.start = 0;
+	} else {
+		cbmf = kept.spool;
+		cpage.start = kp->start;
+	}
+	cpage.chunks = kp->chunks;
+	cpage.black = kp->black;
+	rewind_page();
+}
+
+/* Starts the next collated copy from its first page, returns 0 when
+ * all of them are printed
+ */
+static int next_copy (int *copy, int *page, FILE *jobin)
+{
+	if (!collate || (++*copy >= copies))
+		return 0;
+	if (jobin)
+	{
+		if (!job_seek (jobin, 0) || !job_read_page (jobin))
+			return 0;
+	} else {
+		if (!kept.count)
+			return 0;
+		kept_load (0);
+	}
+	message ("Copy %d of %d\n", *copy + 1, copies);
+	*page = 0;
+	return 1;
+}
+
+/* Checkpoints (-k name). The job is first compressed to name.job, unless
+ * it already is a job file, and printed from there. name holds the
+ * number of pages printed, of bands sent of the next page and the copy
+ * printed (see next_copy()), or copies of the page done without -C,
+ * then the size and hash of the input and the layout it was spooled
+ * with (-N, -a, -t, -l). A run finding it resumes after the last printed
+ * page, from the same job, if its input and layout are the same.
+ * Both files are removed once the whole job is printed.
+ */
+static char *ckptname = NULL;
+static char *ckptspool = NULL;	/* name.job, if we made it */
+static int ckpt_live = 0;	/* printing from the job has started */
+static int ckpt_page = 0;
+static int ckpt_copy = 0;
+static unsigned long ckpt_hash;	/* of the input */
+static long ckpt_size;
+
+static void checkpoint (void)
+{
+	FILE *f;
+
+	if (!ckpt_live)
+		return;
+	if (!(f = fopen (ckptname, "w")))
+	{
+		message ("Can't write the checkpoint %s\n", ckptname);
+		return;
+	}
+	fprintf (f, "%d %d %d %08lx %ld %d %d %d %d\n", ckpt_page, tp.bands,
+		 ckpt_copy, ckpt_hash, ckpt_size, nup, rotation, topskip,
+		 leftskip);
+	fclose (f);
+}
+
+/* Reads the whole input for its size and FNV-1a hash. A pipe is copied
+ * on the way to a temporary file, returned to be read in its place.
+ */
+static FILE *ckpt_identify (FILE *f, unsigned long *hash, long *size)
+{
+	static unsigned char buf[65536];
+	struct stat st;
+	FILE *copy = NULL;
+	unsigned long h = 2166136261UL;
+	size_t len, i;
+
+	if (fstat (fileno (f), &st) || !S_ISREG (st.st_mode))
+		copy = open_tmp();
+	*size = 0;
+	while ((len = fread (buf, 1, sizeof (buf), f)))
+	{
+		for (i = 0; i < len; i++)
+			h = ((h ^ buf[i]) * 16777619UL) & 0xffffffff;
+		*size += len;
+		if (copy && (fwrite (buf, 1, len, copy) != len))
+		{
+			message ("Can't copy the input\n");
+			errorexit();
+		}
+	}
+	*hash = h;
+	if (!copy)
+		copy = f;
+	fseek (copy, 0, SEEK_SET);
+	return copy;
+}
+
+/* Returns the first page to print from *jobin */
+static int ckpt_open (FILE **jobin, FILE *bitmapf, int verify)
+{
+	FILE *f;
+	FILE *input;
+	unsigned long hash;
+	long size;
+	int band;
+	int n, a, t, l;
+
+	if (!*jobin)
+	{
+		ckptspool = malloc (strlen (ckptname) + 5);
+		if (!ckptspool)
+		{
+			message ("Not enough memory\n");
+			errorexit();
+		}
+		sprintf (ckptspool, "%s.job", ckptname);
+	}
+
+	input = ckpt_identify (*jobin ? *jobin : bitmapf, &ckpt_hash, &ckpt_size);
+	if (*jobin && (input != *jobin))
+	{
+		fclose (*jobin);
+		*jobin = input;
+	}
+
+	if ((f = fopen (ckptname, "r")))
+	{
+		if (fscanf (f, "%d %d %d %lx %ld %d %d %d %d", &ckpt_page, &band,
+			    &ckpt_copy, &hash, &size, &n, &a, &t, &l) != 9)
+		{
+			message ("Bad checkpoint %s, or without the identity of "
+				 "its input: remove it to start over\n", ckptname);
+			errorexit();
+		}
+		fclose (f);
+		if ((hash != ckpt_hash) || (size != ckpt_size))
+		{
+			message ("Checkpoint %s is for another input (%ld bytes, "
+				 "hash %08lx, this one %ld bytes, hash %08lx): "
+				 "remove it to start over\n", ckptname, size,
+				 hash, ckpt_size, ckpt_hash);
+			errorexit();
+		}
+		if ((n != nup) || (a != rotation) || (t != topskip)
+		    || (l != leftskip))
+		{
+			message ("Checkpoint %s was spooled with -N %d -a %d -t %d "
+				 "-l %d, not -N %d -a %d -t %d -l %d: remove it to "
+				 "start over\n", ckptname, n, a, t, l, nup, rotation,
+				 topskip, leftskip);
+			errorexit();
+		}
+		if (!*jobin && !(*jobin = fopen (ckptspool, "r")))
+		{
+			message ("Can't open the spooled job %s\n", ckptspool);
+			errorexit();
+		}
+		message ("Resuming after page %d (%d bands of the next one "
+			 "were sent)\n", ckpt_page, band);
+		ckpt_live = 1;
+		return ckpt_page;
+	}
+
+	if (!*jobin)
+	{
+		if (!(*jobin = fopen (ckptspool, "w+")))
+		{
+			message ("Can't create the spooled job %s\n", ckptspool);
+			errorexit();
+		}
+		spool_job (input, *jobin, verify);
+		fseek (*jobin, 0, SEEK_SET);
+		if (input != bitmapf)
+			fclose (input);
+	}
+	ckpt_live = 1;
+	checkpoint();
+	return 0;
+}
+
+static void ckpt_done (void)
+{
+	if (!ckpt_live)
+		return;
+	ckpt_live = 0;
+	unlink (ckptname);
+	if (ckptspool)
+		unlink (ckptspool);
+}
+
+static void errorexit (void)
+{
+#ifdef DEBUG
+	int *i = 0;
+	(*i)++;
+#endif
+	if (rt_active)
+	{
+		rt_active = 0;
+		rt_flush();
+	}
+	checkpoint();
+	if (cbmf)
+		fclose (cbmf);
+	exit (1);
+}
+
+/* Real-time transmit: SCHED_FIFO on a single core, with every page
+ * locked in memory. Compression and logging stay outside of it.
+ */
+static void rt_setup (void)
+{
+	volatile unsigned char stack[RT_STACK];
+	struct sched_param sp;
+	int i;
+
+	if (mlockall (MCL_CURRENT | MCL_FUTURE))
+		message ("Warning, can't lock the memory.\n");
+	/* prefault the stack and the packet buffer */
+	for (i = 0; i < sizeof (stack); i += 1024)
+		stack[i] = 0;
+	memset (tp.pkts, 0, sizeof (tp.pkts));
+
+	sched_getaffinity (0, sizeof (rt_mask), &rt_mask);
+	sp.sched_priority = RT_PRIORITY;
+	if (sched_setscheduler (0, SCHED_FIFO, &sp))
+	{
+		message ("Warning, SCHED_FIFO not allowed, "
+			 "real-time mode disabled.\n");
+		rt_cpu = -1;
+		return;
+	}
+	sp.sched_priority = 0;
+	sched_setscheduler (0, SCHED_OTHER, &sp);
+}
+
+static void rt_begin (void)
+{
+	struct sched_param sp;
+	cpu_set_t mask;
+
+	if (rt_cpu < 0)
+		return;
+	CPU_ZERO (&mask);
+	CPU_SET (rt_cpu, &mask);
+	if (sched_setaffinity (0, sizeof (mask), &mask))
+		message ("Warning, can't run on cpu %d.\n", rt_cpu);
+	sp.sched_priority = RT_PRIORITY;
+	sched_setscheduler (0, SCHED_FIFO, &sp);
+	memset (&tp.lat, 0, sizeof (tp.lat));
+	tp.timed = 1;
+	rt_active = 1;
+}
+
+static void rt_end (const char *what)
+{
+	struct sched_param sp;
+
+	if (!rt_active)
+		return;
+	rt_active = 0;
+	tp.timed = 0;
+	sp.sched_priority = 0;
+	sched_setscheduler (0, SCHED_OTHER, &sp);
+	sched_setaffinity (0, sizeof (rt_mask), &rt_mask);
+	rt_flush();
+
+	message ("RT %s: %ld sleeps, overshoot avg %ld max %ld usec, "
+		 "%ld deadline misses\n", what, tp.lat.sleeps,
+		 tp.lat.sleeps ? tp.lat.total / tp.lat.sleeps : 0,
+		 tp.lat.max, tp.lat.misses);
+	rt_job.sleeps += tp.lat.sleeps;
+	rt_job.total += tp.lat.total;
+	if (tp.lat.max > rt_job.max)
+		rt_job.max = tp.lat.max;
+	rt_job.misses += tp.lat.misses;
+}
+
+/* Timing profiles (-P file), lines of "model key usec" where the keys
+ * are the delays of struct lbp_timing and the costs of struct lbp_cost.
+ * # starts a comment.
+ */
+static struct lbp_printer printer;	/* the model in use, with its profile */
 
-	message ("Printer reseted.\n");
-}
+static const struct
+{
+	const char *name;
+	int offset;
+	int reset;	/* calibrated with resets rather than pages */
+} timing_keys[] =
+{
+	{ "cmd", offsetof (struct lbp_timing, cmd), 0 },
+	{ "data", offsetof (struct lbp_timing, data), 0 },
+	{ "check", offsetof (struct lbp_timing, check), 0 },
+	{ "init", offsetof (struct lbp_timing, init), 0 },
+	{ "trailer", offsetof (struct lbp_timing, trailer), 0 },
+	{ "reset_status", offsetof (struct lbp_timing, reset_status), 1 },
+	{ "reset_step", offsetof (struct lbp_timing, reset_step), 1 },
+	{ "reset_flush", offsetof (struct lbp_timing, reset_flush), 1 },
+	{ NULL }
+};
 
-static int print_page (struct printer *prt, int page)
+static const struct
 {
-	int i = 0;
-	int inited = 0; // 0: the printer is not ready,
-			// 1: started to init the page,
-			// 2: started to print (there is paper)
-	int ret = 0;
-	int offset = 0;
-	int len = 0;
-	int size;
+	const char *name;
+	int offset;
+} cost_keys[] =
+{
+	{ "port_io", offsetof (struct lbp_cost, port_io) },
+	{ "sleep_slack", offsetof (struct lbp_cost, sleep_slack) },
+	{ "band_ready", offsetof (struct lbp_cost, band_ready) },
+	{ "paper_feed", offsetof (struct lbp_cost, paper_feed) },
+	{ "reset", offsetof (struct lbp_cost, reset) },
+	{ NULL }
+};
 
-	int *data = pagedata;
+static int *timing_delay (struct lbp_timing *tm, int key)
+{
+	return (int *)((char *)tm + timing_keys[key].offset);
+}
 
-	struct timeval printinittv;
-	struct timeval printnewtv;
+static int *cost_value (struct lbp_cost *cost, int key)
+{
+	return (int *)((char *)cost + cost_keys[key].offset);
+}
 
-	message ("Sending page...\n");
-	i = 0; //Band counter
+/* The delay or cost called key, NULL if none */
+static int *profile_value (struct lbp_printer *p, const char *key)
+{
+	int i;
 
-	gettimeofday (&printinittv, NULL);
+	for (i = 0; timing_keys[i].name; i++)
+		if (!strcmp (timing_keys[i].name, key))
+			return timing_delay (&p->timing, i);
+	for (i = 0; cost_keys[i].name; i++)
+		if (!strcmp (cost_keys[i].name, key))
+			return cost_value (&p->cost, i);
+	return NULL;
+}
 
-	while (1)
+static void profile_load (const char *name)
+{
+	FILE *f;
+	char line[256];
+	char model[64];
+	char key[64];
+	char *p;
+	int *value;
+	int usec;
+	int lineno = 0;
+	int n = 0;
+
+	if (!(f = fopen (name, "r")))
+	{
+		message ("Can't read the timing profile %s\n", name);
+		errorexit();
+	}
+	while (fgets (line, sizeof (line), f))
 	{
-		ret = cmdout (0);
-		if (!inited)
+		lineno++;
+		if ((p = strchr (line, '#')))
+			*p = 0;
+		if (sscanf (line, "%63s %63s %d", model, key, &usec) != 3)
 		{
-			gettimeofday (&printnewtv, NULL);
-			if ((printnewtv.tv_sec - printinittv.tv_sec) > 3)
+			if (sscanf (line, "%63s", model) == 1)
 			{
-				reset_printer (prt);
-				gettimeofday (&printinittv, NULL);
+				message ("%s:%d: expected model, key and usec\n",
+					 name, lineno);
+				errorexit();
 			}
+			continue;
+		}
+		if (strcmp (model, printer.name))
+			continue;
+		if (!(value = profile_value (&printer, key)) || (usec < 0))
+		{
+			message ("%s:%d: bad key %s %d\n", name, lineno, key, usec);
+			errorexit();
 		}
+		*value = usec;
+		n++;
+	}
+	fclose (f);
+	message ("Timing profile %s: %d values for %s\n", name, n, printer.name);
+}
+
+/* Writes the delays and costs of p over the lines of its model */
+static void profile_save (const char *name, struct lbp_printer *p)
+{
+	FILE *f;
+	FILE *keep;
+	char *kept_lines = NULL;
+	size_t len = 0;
+	char line[256];
+	char model[64];
+	int i;
 
-		if ((cmdout(2) & 0xf0) == 0x40)
-		{ //0x40 or 0x48
-			if (!inited)
-				inited = 1;
+	if (!(keep = open_memstream (&kept_lines, &len)))
+	{
+		message ("Not enough memory\n");
+		errorexit();
+	}
+	if ((f = fopen (name, "r")))
+	{ /* the other models */
+		while (fgets (line, sizeof (line), f))
+			if ((sscanf (line, "%63s", model) != 1)
+			    || strcmp (model, p->name))
+				fputs (line, keep);
+		fclose (f);
+	}
+	fclose (keep);
 
-			len = -data[offset];
-			if (len == 260)
-			{
-				offset = 0;
-				data = bandinit;
-			} else if (len > 255) {
-				message ("Sending band %d...\n", i);
-				if ((! feof (cbmf)) && fread (&size, 1, sizeof (int), cbmf))
-				{
-					int type = len - 256;
+	if (!(f = fopen (name, "w")))
+	{
+		message ("Can't write the timing profile %s\n", name);
+		errorexit();
+	}
+	fputs (kept_lines, f);
+	for (i = 0; timing_keys[i].name; i++)
+		fprintf (f, "%s %s %d\n", p->name, timing_keys[i].name,
+			 *timing_delay (&p->timing, i));
+	for (i = 0; cost_keys[i].name; i++)
+		fprintf (f, "%s %s %d\n", p->name, cost_keys[i].name,
+			 *cost_value (&p->cost, i));
+	fclose (f);
+	free (kept_lines);
+	message ("Timing profile of %s saved to %s\n", p->name, name);
+}
 
-					size = size & 0x0FFF;
+/* Calibration (-A file). Each delay is searched down from its current
+ * value, halving the range between the largest one that failed and the
+ * smallest one that passed. The delays of the reset are tried with
+ * resets before the job, the others on its pages: a page failing with
+ * a trial delay is sent again with the one that passed. The file gets
+ * the delays found, plus CALIBRATE_MARGIN percent, and the ones left
+ * unsearched as they were.
+ */
+static struct
+{
+	const char *file;
+	int key;	/* delay tried on the pages, -1 once all are found */
+	int lo;		/* lo - 1 failed */
+	int hi;		/* hi passed */
+	int trial;	/* a page is sent with a trial delay */
+	unsigned found;	/* 1 << key of the delays searched to the end */
+	struct lbp_timing start;	/* the delays before the search */
+} calib = { .key = -1 };
+
+static void calib_resets (void)
+{
+	int *d;
+	int lo, hi;
+	int ret = 0;
+	int i;
 
-					fread (cbm, size * 4, 1, cbmf);
-					ret = print_band (i, size, type, 0,
-							  (inited - 1) || (i == 0));
-					if (!ret)
-						return 0;
-					else if ((ret & 0xf0) != 0x70)
-						inited = 2;
-				} else {
-					break;
-				}
-				offset++;
+	for (i = 0; timing_keys[i].name; i++)
+	{
+		if (!timing_keys[i].reset)
+			continue;
+		d = timing_delay (&printer.timing, i);
+		lo = 0;
+		hi = *d;
+		while (lo < hi)
+		{
+			*d = (lo + hi) / 2;
+			rt_begin();
+			ret = lbp_reset (&tp);
+			rt_end ("reset");
+			message ("Calibrating %s: %d usec %s\n", timing_keys[i].name,
+				 *d, ret ? "failed" : "passed");
+			if (ret)
+				lo = *d + 1;
+			else
+				hi = *d;
+		}
+		*d = hi;
+		calib.found |= 1 << i;
+	}
+	if (ret)
+	{ /* the last trial failed */
+		rt_begin();
+		ret = lbp_reset (&tp);
+		rt_end ("reset");
+		if (ret)
+			errorexit();
+	}
+}
 
-				i++;
-			} else if (len > 1) {
-				if (data[offset + 2] == -1)
-				{
-					data[offset + 2] = (i % 2) + 1;
-					data64out (data, offset + 1, offset + 1 + len);
-					data[offset + 2] = -1;
-				} else {
-					data64out (data, offset + 1, offset + 1 + len);
-				}
-				offset += len + 1;
-			} else {
-				data6out (data[offset + 1]);
-				offset += 2;
-			}
+/* Sets the delay to try on the next page */
+static void calib_page (void)
+{
+	int *d;
+
+	while (calib.key >= 0)
+	{
+		d = timing_delay (&printer.timing, calib.key);
+		if (calib.lo < calib.hi)
+		{
+			*d = (calib.lo + calib.hi) / 2;
+			calib.trial = 1;
+			return;
+		}
+		*d = calib.hi;
+		calib.found |= 1 << calib.key;
+		message ("Calibrated %s: %d usec\n", timing_keys[calib.key].name, *d);
+		do
+			calib.key++;
+		while (timing_keys[calib.key].name && timing_keys[calib.key].reset);
+		if (!timing_keys[calib.key].name)
+			calib.key = -1;
+		else
+		{
+			calib.lo = 0;
+			calib.hi = *timing_delay (&printer.timing, calib.key);
 		}
 	}
-	message ("OK\n");
+}
+
+/* Result of the page, returns 1 if it was sent with a trial delay */
+static int calib_result (int ok)
+{
+	int *d;
+
+	if (!calib.trial)
+		return 0;
+	calib.trial = 0;
+	d = timing_delay (&printer.timing, calib.key);
+	message ("Calibrating %s: %d usec %s\n", timing_keys[calib.key].name,
+		 *d, ok ? "passed" : "failed");
+	if (ok)
+		calib.hi = *d;
+	else
+	{
+		calib.lo = *d + 1;
+		*d = calib.hi;
+	}
 	return 1;
 }
 
-static struct printer *get_printer (const char *name)
+/* Starts the search of the delays tried on the pages */
+static void calib_begin (void)
+{
+	calib.key = 0;
+	while (timing_keys[calib.key].reset)
+		calib.key++;
+	calib.lo = 0;
+	calib.hi = *timing_delay (&printer.timing, calib.key);
+}
+
+/* The delays to save: the ones found get margin percent, at least
+ * CALIBRATE_FLOOR usec but never beyond where their search started,
+ * the others stay as they were loaded.
+ */
+static void calib_timing (struct lbp_timing *tm, int margin)
 {
+	char names[128] = "";
+	int usec;
+	int add;
 	int i;
-	for (i = 0; printers[i].name; i++)
-		if (strcmp (printers[i].name, name) == 0)
-			return &printers[i];
-	return NULL;
+
+	*tm = calib.start;
+	for (i = 0; timing_keys[i].name; i++)
+	{
+		if (!(calib.found & (1 << i)))
+			continue;
+		usec = *timing_delay (&printer.timing, i);
+		add = (usec * margin + 99) / 100;
+		if (add < CALIBRATE_FLOOR)
+			add = CALIBRATE_FLOOR;
+		if (usec + add < *timing_delay (tm, i))
+			*timing_delay (tm, i) = usec + add;
+		strcat (names, " ");
+		strcat (names, timing_keys[i].name);
+	}
+	if (calib.found)
+		message ("Calibrated delays (%d%% margin):%s\n", margin, names);
+	else
+		message ("No delay calibrated\n");
+}
+
+/* Cost fitting (-M file): the costs of the simulate mode (-s), from
+ * the waits and sleeps timed during this run.
+ */
+static const char *fit_file;
+
+static void fit_cost (struct lbp_cost *cost)
+{
+	if (!lbp_fit_cost (&tp.fit, cost))
+	{
+		message ("No timing to fit the costs\n");
+		return;
+	}
+	message ("Costs fitted on %ld pages, %ld bands, %ld resets: port_io %d, "
+		 "sleep_slack %d, band_ready %d, paper_feed %d, reset %d usec\n",
+		 tp.fit.pages, tp.fit.readies + tp.fit.feeds, tp.fit.resets,
+		 cost->port_io, cost->sleep_slack, cost->band_ready,
+		 cost->paper_feed, cost->reset);
+}
+
+/* Band packing stress benchmark (-X pages). Encodes synthetic pages
+ * (see bench_row()) without any input or output file, and reports how
+ * the bands were split, and the time of each band class against the
+ * generic loop.
+ */
+static struct
+{
+	int chunks;
+	int truncated;	/* chunks with the band going on in the next one */
+} bench;
+
+static const unsigned char bayer[8][8] =
+{
+	{  0, 32,  8, 40,  2, 34, 10, 42 },
+	{ 48, 16, 56, 24, 50, 18, 58, 26 },
+	{ 12, 44,  4, 36, 14, 46,  6, 38 },
+	{ 60, 28, 52, 20, 62, 30, 54, 22 },
+	{  3, 35, 11, 43,  1, 33,  9, 41 },
+	{ 51, 19, 59, 27, 49, 17, 57, 25 },
+	{ 15, 47,  7, 39, 13, 45,  5, 37 },
+	{ 63, 31, 55, 23, 61, 29, 53, 21 }
+};
+
+static int bench_flush (void *arg, const unsigned char *pkts, int count,
+			int truncated)
+{
+	bench.chunks++;
+	if (truncated)
+		bench.truncated++;
+	return 0;
+}
+
+static int bench_plain (void *arg, const unsigned char *pkts, int count,
+			int truncated)
+{
+	return 0;
+}
+
+/* A page has a white margin, a dithered gradient, which is mostly runs,
+ * and noise like a scanned photo, so that its bands go through the
+ * blank, sparse and dense paths of the encoder.
+ */
+static void bench_row (unsigned char *row, int y, int page)
+{
+	static unsigned int seed = 1;
+	int x, bit;
+	int gray;
+	unsigned char c;
+
+	if (y < lines_by_page / 8)
+	{
+		memset (row, 0, LINE_SIZE);
+		return;
+	}
+	if (y >= lines_by_page * 5 / 8)
+	{
+		for (x = 0; x < LINE_SIZE; x++)
+		{
+			seed = seed * 1103515245 + 12345;
+			row[x] = seed >> 16;
+		}
+		return;
+	}
+	for (x = 0; x < LINE_SIZE; x++)
+	{
+		c = 0;
+		for (bit = 0; bit < 8; bit++)
+		{
+			gray = ((x * 8 + bit + y) / 16 + page * 37) & 0x7f;
+			if (gray > 63)
+				gray = 127 - gray;
+			if (gray > bayer[y & 7][bit])
+				c |= 0x80 >> bit;
+		}
+		row[x] = c;
+	}
+}
+
+static void bench_encode (int pages)
+{
+	static unsigned char bandbuf[LINE_SIZE * (ROWS_BY_BAND + 1)];
+	static struct lbp_encoder enc;
+	static struct lbp_encoder plain;
+	struct enc_stat plain_stats[LBP_BAND_CLASSES];
+	struct timeval tv;
+	long t = 0;
+	long bytes = 0;
+	long packets = 0;
+	int split = 0;	/* bands over MAX_PACKET_COUNT */
+	int bands = 0;
+	int max = 0;
+	int page, line, rows, carry, pktcnt, i;
+
+	memset (plain_stats, 0, sizeof (plain_stats));
+	lbp_encoder_init (&enc, bench_flush, NULL);
+	lbp_encoder_init (&plain, bench_plain, NULL);
+	plain.generic = 1;
+	for (page = 0; page < pages; page++)
+	{
+		carry = 0;
+		for (line = 0; line < lines_by_page; line += rows)
+		{
+			rows = lines_by_page - line;
+			if (rows > ROWS_BY_BAND)
+				rows = ROWS_BY_BAND;
+			for (i = 0; i < rows; i++)
+				bench_row (bandbuf + carry + i * LINE_SIZE,
+					   line + i, page);
+
+			gettimeofday (&tv, NULL);
+			pktcnt = lbp_encode_band (&enc, bandbuf,
+						  LINE_SIZE * rows - 2);
+			enc_stats[enc.band_class].usec += elapsed (&tv);
+			t += elapsed (&tv);
+			enc_stats[enc.band_class].bytes += LINE_SIZE * rows - 2;
+			enc_stats[enc.band_class].bands++;
+
+			gettimeofday (&tv, NULL);
+			lbp_encode_band (&plain, bandbuf, LINE_SIZE * rows - 2);
+			plain_stats[enc.band_class].usec += elapsed (&tv);
+			plain_stats[enc.band_class].bytes += LINE_SIZE * rows - 2;
+			plain_stats[enc.band_class].bands++;
+
+			memmove (bandbuf, bandbuf + LINE_SIZE * rows - 2, carry + 2);
+			carry += 2;
+			bytes += LINE_SIZE * rows - 2;
+			packets += pktcnt;
+			if (pktcnt > MAX_PACKET_COUNT)
+				split++;
+			if (pktcnt > max)
+				max = pktcnt;
+			bands++;
+		}
+	}
+	message ("Stress: %d pages, %d bands, %d split in %d chunks "
+		 "(%d quick inits), %ld packets, max %d by band, "
+		 "%ld ms, %ld MB/s\n", pages, bands, split, bench.chunks,
+		 bench.truncated, packets, max, t / 1000, t ? bytes / t : 0);
+	enc_report ("Classes", enc_stats);
+	enc_report ("Generic loop", plain_stats);
 }
 
 int main (int argc, char **argv)
@@ -923,14 +2413,28 @@ int main (int argc, char **argv)
 	int simulate = 0;
 	int reset_only = 0;
 	int reset = 0;
-	int tfd;
 	int lbp460 = 0;
+	int verify = 0;
+	int hardware;
+	int first = 0; /* first page to print */
+	int stress = 0; /* benchmark pages */
+	int tries;
+	int ret;
 
-	struct printer *prt = get_printer ("LBP-660");
+	const struct lbp_printer *prt = lbp_get_printer ("LBP-660");
 
 	FILE *bitmapf = stdin;
+	FILE *jobout = NULL; /* compress-only, to a job file */
+	FILE *jobin = NULL; /* print-only, from a job file */
+	FILE *recordf = NULL; /* port recording */
+	const char *profile = NULL; /* timing profile */
+	struct lbp_printer saved; /* profile written by -A and -M */
+	struct lbp_record record;
+
+	lbp_transport_init (&tp, prt, NULL);
+	tp.log = vmessage;
 
-	while ((c = getopt (argc, argv, "Rrt:l:sf:c")) != -1)
+	while ((c = getopt (argc, argv, "Rrt:l:sf:cVo:j:F:p:bv:k:X:Ta:n:Cm:P:A:M:N:")) != -1)
 	{
 		switch (c)
 		{
@@ -942,7 +2446,7 @@ int main (int argc, char **argv)
 			reset = 1;
 			break;
 		case 'c':
-			prt = get_printer ("LBP-460");
+			prt = lbp_get_printer ("LBP-460");
 			lbp460 = 1;
 			break;
 		case 't':
@@ -954,6 +2458,80 @@ int main (int argc, char **argv)
 		case 's':
 			simulate++;
 			break;
+		case 'V':
+			verify = 1;
+			break;
+		case 'F':
+			sscanf (optarg, "%d", &rt_cpu);
+			break;
+		case 'p':
+			recordf = fopen (optarg, "w");
+			if (!recordf)
+			{
+				message ("Can't create the port recording\n");
+				errorexit();
+			}
+			lbp_record_port (&tp.port, &record, recordf);
+			break;
+		case 'b':
+			tp.burst = 0;
+			break;
+		case 'k':
+			ckptname = optarg;
+			break;
+		case 'T':
+			source = &text_source;
+			break;
+		case 'a':
+			sscanf (optarg, "%d", &rotation);
+			if ((rotation != 90) && (rotation != 180)
+			    && (rotation != 270))
+			{
+				message ("Rotation must be 90, 180 or 270\n");
+				errorexit();
+			}
+			break;
+		case 'X':
+			sscanf (optarg, "%d", &stress);
+			break;
+		case 'N':
+			sscanf (optarg, "%d", &nup);
+			if ((nup != 2) && (nup != 4))
+			{
+				message ("N-up must be 2 or 4\n");
+				errorexit();
+			}
+			break;
+		case 'n':
+			sscanf (optarg, "%d", &copies);
+			if (copies < 1)
+				copies = 1;
+			break;
+		case 'C':
+			collate = 1;
+			break;
+		case 'P':
+			profile = optarg;
+			break;
+		case 'A':
+			calib.file = optarg;
+			break;
+		case 'M':
+			fit_file = optarg;
+			break;
+		case 'm':
+			sscanf (optarg, "%ld", &keep_budget);
+			keep_budget <<= 20;
+			break;
+		case 'v':
+			if (!strcmp (optarg, "deferred"))
+				tp.deferred = 1;
+			else if (strcmp (optarg, "strict"))
+			{
+				message ("Unknown verification policy %s\n", optarg);
+				errorexit();
+			}
+			break;
 		case 'f':
 			bitmapf = fopen (optarg, "r");
 			if (!bitmapf)
@@ -961,78 +2539,344 @@ int main (int argc, char **argv)
 				message ("File not found or unreadable\n");
 				errorexit();
 			}
+			break;
+		case 'o':
+			jobout = fopen (optarg, "w");
+			if (!jobout)
+			{
+				message ("Can't create the job file\n");
+				errorexit();
+			}
+			break;
+		case 'j':
+			jobin = fopen (optarg, "r");
+			if (!jobin)
+			{
+				message ("Job file not found or unreadable\n");
+				errorexit();
+			}
 		}
 	}
 
-	if (ioperm (DATA, 3, 1))
+	if (rotation && nup)
+	{
+		message ("Rotation (-a) and N-up (-N) don't go together\n");
+		errorexit();
+	}
+	if (rotation && (source == &text_source))
+	{
+		message ("Rotation (-a) is for bitmaps, not text (-T)\n");
+		errorexit();
+	}
+	if (rotation && jobin)
+	{
+		message ("Rotation (-a) can't change a job file (-j), "
+			 "give it when compressing (-o)\n");
+		errorexit();
+	}
+	if (nup && (source == &text_source))
+	{
+		message ("N-up (-N) is for bitmaps, not text (-T)\n");
+		errorexit();
+	}
+	if (nup && jobin)
+	{
+		message ("N-up (-N) can't change a job file (-j), "
+			 "give it when compressing (-o)\n");
+		errorexit();
+	}
+	if (rotation && (source == &pbm_source))
+		source = &rot_source;
+	if (nup && (source == &pbm_source))
+		source = &nup_source;
+	if (jobout) /* copies are for printing */
+		copies = 1;
+
+	hardware = !simulate && !jobout && !recordf && !stress;
+
+	if (calib.file && !hardware)
+	{
+		message ("The calibration (-A) needs the printer\n");
+		errorexit();
+	}
+
+	if (fit_file && !hardware)
+	{
+		message ("The cost fitting (-M) needs the printer\n");
+		errorexit();
+	}
+
+	if (hardware && lbp_direct_port (&tp.port))
 	{
 		message ("Sorry, you were not able to gain access to the ports\n");
 		message ("You must be root to run this program\n");
 		errorexit();
 	}
 
-	/* select the right page resolution */
+	/* select the right page resolution, and the delays */
+	printer = *prt;
+	prt = &printer;
+	if (profile)
+		profile_load (profile);
+	tp.prt = prt;
 	lines_by_page = prt->lines_by_page;
+
+	if (verify && !(vpage = malloc (lines_by_page * LINE_SIZE)))
+	{
+		message ("Not enough memory for the round-trip check\n");
+		errorexit();
+	}
 	
 	message ("%s\n", lbp460 ?
 		 "Running with LBP-460 page resolution (600x300)." :
 		 "Running with LBP-660 page resolution (600x600).");
 
-	if ((reset && !simulate) || (lbp460))
-		reset_printer (prt);
+	if (stress)
+	{
+		bench_encode (stress);
+		return 0;
+	}
+
+	if (simulate || jobout)
+		rt_cpu = -1;
+	if (rt_cpu >= 0)
+		rt_setup();
+
+	if (hardware && (reset || lbp460))
+	{ /* -R and the LBP-460 always do the full reset */
+		rt_begin();
+		ret = (reset_only || lbp460) ? 0 : lbp_probe (&tp);
+		if (ret <= 0)
+			ret = lbp_reset (&tp);
+		rt_end ("reset");
+		if (ret < 0)
+			errorexit();
+	}
+
+	if (calib.file && !reset_only)
+	{
+		calib.start = printer.timing;
+		calib_resets();
+		calib_begin();
+	}
+
+	if (ckptname && !simulate && !jobout && !reset_only)
+		first = ckpt_open (&jobin, bitmapf, verify);
+
+	if (jobout)
+		job_begin (jobout);
+	if (jobin)
+	{
+		job_check (jobin);
+		if (first && !job_seek (jobin, first))
+			message ("Nothing left to print.\n");
+	}
 
 	if (!reset_only)
 	{
 		/* pages printing loop */
 		struct timeval ltv;
 		struct timeval ntv;
+		struct timeval ctv;
+
+		struct lbp_estimate est;
+		long job_time = 0;
+		long job_wire = 0;
+		long bp;
+		long t;
+		long gap;
 
 		int page;
+		int copy = ckpt_copy;	/* collated: copy printed, or else copies
+					   of the page done */
+		int sheets = 0;		/* pages printed, copies included */
 		
-		for (page = 0;;page++)
+		for (page = first;;page++)
 		{
-			/* temporary file to store our results */
-			char tmpname[] = "/tmp/lbp660-XXXXXX";
-			if ((tfd = mkstemp (tmpname)) < 0)
-			{
-				message ("Can't open a temporary file.\n");
-				errorexit();
+			gettimeofday (&ctv, NULL);
+			if (jobin)
+			{ /* print-only, the pages are already compressed */
+				if (! job_read_page (jobin)
+				    && ! next_copy (&copy, &page, jobin))
+					break;
+			} else if (collate && copy) {
+				if (page < kept.count)
+					kept_load (page);
+				else if (! next_copy (&copy, &page, jobin))
+					break;
+			} else {
+				cbmf = open_tmp();
+				if (! compress_bitmap (bitmapf))
+				{
+					fclose (cbmf);
+					if (! next_copy (&copy, &page, jobin))
+						break;
+				} else {
+					if (verify)
+						verify_page (page);
+
+					if (jobout)
+					{ /* compress-only, the job file counts once */
+						cov_sheet();
+						job_write_page (jobout);
+						goto page_printed;
+					}
+					if (collate && (copies > 1))
+						keep_page();
+				}
 			}
-			cbmf = fdopen (tfd, "w+");
-			unlink (tmpname);
 
-			if (! compress_bitmap (bitmapf))
-				break;
-
-			/* If simulating, skip actual printing. */
-			if (simulate)
-				goto page_printed;
-			
-			if (page != 0)
-			{
-				gettimeofday (&ntv, NULL);
-				/* delay between pages */
-				usleep (PAGE_DELAY - ((ntv.tv_usec - ltv.tv_usec)
-						      + ((ntv.tv_sec - ltv.tv_sec)
-							 * 1000000)));
-			}
-			
-			if (! print_page (prt, page))
+			for (;; rewind_page())
 			{
-				message ("Error, cannot print this page.\n");
-				reset_printer (prt);
-				errorexit();
+				/* If simulating, skip actual printing, only estimate it. */
+				if (simulate)
+				{
+					lbp_estimate_page (prt, tp.deferred, &chunks, &est);
+					t = lbp_est_time (prt, &est);
+					message ("Page %d: %d bands, %d quick inits, %d packets, "
+						 "%ld bytes on wire, %ld.%03ld s\n", page, est.bands,
+						 est.quick, est.packets, est.wire, t / 1000000,
+						 (t / 1000) % 1000);
+					if (sheets != 0)
+					{ /* the compression runs during the delay between pages */
+						gap = elapsed (&ctv);
+						t += gap > PAGE_DELAY ? gap : PAGE_DELAY;
+						gettimeofday (&ctv, NULL);
+					}
+					job_time += t;
+					job_wire += est.wire;
+					cov_sheet();
+					sheets++;
+					if (collate || (++copy >= copies))
+						break;
+					continue;
+				}
+
+				if (hardware && (sheets != 0))
+				{
+					gettimeofday (&ntv, NULL);
+					/* delay between pages */
+					usleep (PAGE_DELAY - ((ntv.tv_usec - ltv.tv_usec)
+							      + ((ntv.tv_sec - ltv.tv_sec)
+								 * 1000000)));
+				}
+
+				calib_page();
+				rt_begin();
+				for (tries = 0; (ret = lbp_print_page (&tp, &chunks, page)) != 1;
+				     tries++)
+				{
+					rt_end ("page");
+					calib_result (0);
+					checkpoint();
+					if (tries == PRINT_RETRIES)
+					{
+						message ("Error, cannot print this page.\n");
+						lbp_reset (&tp);
+						errorexit();
+					}
+					/* the page is still compressed, send it again */
+					message ("Error, page %d failed after %d bands, "
+						 "retrying.\n", page, tp.bands);
+					if (lbp_reset (&tp) < 0)
+						errorexit();
+					rewind_page();
+					rt_begin();
+				}
+				rt_end ("page");
+				calib_result (1);
+				tp.bands = 0;
+				gettimeofday (&ltv, NULL);
+				cov_sheet();
+				sheets++;
+				if (collate || (++copy >= copies))
+				{
+					ckpt_page = page + 1;
+					ckpt_copy = collate ? copy : 0;
+					checkpoint();
+					break;
+				}
+				ckpt_copy = copy;
+				checkpoint();
 			}
-			gettimeofday (&ltv, NULL);
+			if (!collate)
+				copy = 0;
 
 		page_printed:
-			fclose (cbmf);
-			next_page (bitmapf, page);
+			if (!jobin && (cbmf != kept.spool))
+				fclose (cbmf);
+			if (!jobin && !(collate && copy))
+				source->next (bitmapf, page);
+		}
+		cbmf = NULL;
+		ckpt_done();
+
+		if (tp.io)
+			message ("Port: %ld accesses, %ld readbacks saved (%s checks)\n",
+				 tp.io, tp.saved, tp.deferred ? "deferred" : "strict");
+
+		if (rt_job.sleeps)
+			message ("RT job: %ld sleeps, overshoot avg %ld max %ld usec, "
+				 "%ld deadline misses\n", rt_job.sleeps,
+				 rt_job.total / rt_job.sleeps, rt_job.max,
+				 rt_job.misses);
+
+		if (jobout)
+		{
+			job_end (jobout);
+			message ("Job file: %d pages, %ld bytes\n",
+				 job_pages, job_offset);
+		}
+
+		if (cov.pages)
+		{
+			bp = coverage_bp (cov.job, (long)cov.pages * lines_by_page);
+			message ("Coverage: %d sheets, %ld black pixels, "
+				 "%ld.%02ld%% average\n", cov.pages, cov.job,
+				 bp / 100, bp % 100);
+		}
+		if (cov.unknown)
+			message ("Coverage: %d sheets not counted, their job file "
+				 "has no pixel counts (version 1)\n", cov.unknown);
+
+		if (enc_stats[LBP_BAND_BLANK].bands + enc_stats[LBP_BAND_SPARSE].bands
+		    + enc_stats[LBP_BAND_DENSE].bands)
+			enc_report ("Bands", enc_stats);
+
+		if (calib.file || fit_file)
+		{
+			saved = printer;
+			if (calib.file)
+				calib_timing (&saved.timing, CALIBRATE_MARGIN);
+			if (fit_file)
+				fit_cost (&saved.cost);
+			if (calib.file)
+				profile_save (calib.file, &saved);
+			if (fit_file && !(calib.file && !strcmp (fit_file, calib.file)))
+				profile_save (fit_file, &saved);
 		}
+
+		if (kept.count)
+			message ("Copies: %d pages kept, %ld bytes in memory, "
+				 "%ld bytes spooled\n", kept.count, kept.mem,
+				 kept.spooled);
+
+		if (simulate)
+			message ("Job: %d pages, %ld bytes on wire, %ld.%03ld s\n",
+				 sheets, job_wire, job_time / 1000000,
+				 (job_time / 1000) % 1000);
 	}
 
 	if (bitmapf != stdin)
 		fclose (bitmapf);
+	if (jobout)
+		fclose (jobout);
+	if (jobin)
+		fclose (jobin);
+	if (recordf)
+		fclose (recordf);
+	if (kept.spool)
+		fclose (kept.spool);
 
 	return 0;
 }
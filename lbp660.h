@@ -25,9 +25,37 @@
 #define LINES_BY_PAGE460	3484
 #define ROWS_BY_BAND  	104 // number of rows in a band
 
+#define TEXT_COLUMNS 80 // characters by line of the text mode (-T)
+#define TEXT_DOT 10 // pixels by font dot, across the page
+
 #define MAX_PACKET_COUNT 3072 // Maximum number of packet in a transfer
 
 #define PAGE_DELAY 3000000 //Delay between pages, in usec
+#define PRINT_RETRIES 2 // Resets and new tries before giving up a page
+#define PROBE_READS 5 // Ready answers needed to skip the reset
+#define CALIBRATE_MARGIN 25 // Percent added to the calibrated delays (-A)
+#define CALIBRATE_FLOOR 5 // Least margin of a calibrated delay, in usec
+
+#define RT_PRIORITY 50 // SCHED_FIFO priority of the transmit (-F)
+#define RT_DEADLINE 100 // usleep() overshoot counted as a missed deadline, in usec
+#define RT_STACK 65536 // stack prefaulted before going real-time
+
+/* Precompressed job file, written by -o and printed by -j.
+ * Words are 32-bit little endian, offsets are two words, low first.
+ *
+ *   "LBPJ" version lines_by_page flags (0)
+ *   for every page:
+ *     "PAGE" chunks bytes black, black is the count of black pixels
+ *     (version 2, missing in version 1 files)
+ *     chunks times: size word, then size 4-byte packets
+ *   "INDX" pages, then the offset of the "PAGE" tag of every page
+ *   "LBPE" offset of the "INDX" tag
+ *
+ * The size word of a chunk holds the packet count, and 0x10000 when
+ * the band goes on in the next chunk (see out_packet()). Older files
+ * may end such a band with an empty chunk.
+ */
+#define JOB_VERSION 2
 
 /* We must control the device bypassing the kernel driver,
  * because the interface don't follow any standard handshake
@@ -38,6 +66,29 @@
 #define STATUS DATA+1
 #define CONTROL DATA+2
 
+/* Static tracepoints (USDT) for perf and bpftrace, provider lbp660.
+ * They are a single nop in the code, and compile to nothing without
+ * <sys/sdt.h> (systemtap-sdt-dev).
+ */
+#ifdef __has_include
+#if __has_include(<sys/sdt.h>)
+#define HAVE_SYS_SDT_H
+#endif
+#endif
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE0(name)		DTRACE_PROBE (lbp660, name)
+#define TRACE1(name, a)		DTRACE_PROBE1 (lbp660, name, a)
+#define TRACE2(name, a, b)	DTRACE_PROBE2 (lbp660, name, a, b)
+#define TRACE3(name, a, b, c)	DTRACE_PROBE3 (lbp660, name, a, b, c)
+#else
+#define TRACE0(name)
+#define TRACE1(name, a)
+#define TRACE2(name, a, b)
+#define TRACE3(name, a, b, c)
+#endif
+
 #ifdef DEBUG
 #define INLINE 
 #else
@@ -72,5 +123,206 @@ union pkt4 {
 };
 #pragma pack()
 
+/* Library interface, implemented in lbp660lib.c. The encoder turns band
+ * bytes into packets, the transport sends packets to the printer. Both
+ * keep their whole state in the context given to them, and report
+ * errors by return value.
+ */
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+/* Cost model used by the simulate mode to estimate print times.
+ * All durations are in usec. These are starting values, a real run
+ * refits them with lbp_fit_cost() (-M).
+ */
+struct lbp_cost
+{
+	int port_io;		/* one inb() or outb() on the parallel port */
+	int sleep_slack;	/* usleep() overshoot, added to every call */
+	int band_ready;		/* engine latency before accepting a band */
+	int paper_feed;		/* paper pick-up, before the first band */
+	int reset;		/* full reset */
+};
+
+/* Handshake delays, in usec. The defaults are the worst case; a timing
+ * profile (-P) or a calibration (-A) may lower them for a given unit.
+ */
+struct lbp_timing
+{
+	int cmd;		/* command strobe, before reading the status */
+	int data;		/* data write, unchecked */
+	int check;		/* data write, status checked */
+	int init;		/* data writes of the band init */
+	int trailer;		/* band trailer, while the engine takes the band */
+	int reset_status;	/* before the status of the reset */
+	int reset_step;		/* between the steps of the reset handshake */
+	int reset_flush;	/* after the reset flush */
+};
+
+struct lbp_printer
+{
+	const char *name;
+	int lines_by_page;
+	struct lbp_cost cost;
+	struct lbp_timing timing;
+};
+
+/* Port accesses and delays counted by the simulate mode */
+struct lbp_estimate
+{
+	long io;	/* port accesses */
+	long wire;	/* bytes written to the data port */
+	long sleep;	/* usec requested from usleep() */
+	long sleeps;	/* number of usleep() calls */
+	long wait;	/* usec spent waiting for the engine */
+	int bands;
+	int quick;	/* truncated band parts, sent after a quick init */
+	int packets;
+};
+
+/* usleep() overshoot seen by a timed transport */
+struct lbp_latency
+{
+	long sleeps;
+	long total;
+	long max;
+	long misses;	/* overshoots beyond RT_DEADLINE */
+};
+
+/* Timings measured by the transport on the printer, for lbp_fit_cost() */
+struct lbp_fit
+{
+	long ready;	/* usec waited for the engine, bands after the first */
+	long readies;
+	long feed;	/* usec waited for the first band of a page */
+	long feeds;
+	long reset;	/* usec of the full resets */
+	long resets;
+	long sleep;	/* usec requested from usleep() */
+	long sleeps;
+	long slept;	/* usec usleep() took */
+	long busy;	/* usec of the pages, out of the waits and sleeps */
+	long busy_io;	/* port accesses in busy */
+	long pages;
+};
+
+/* Encoder. Each chunk of at most MAX_PACKET_COUNT packets is handed
+ * to flush(), with truncated set if the band goes on in the next
+ * chunk. flush() returns 0, or -1 on error.
+ * Bands are classified first, and blank, sparse and dense ones go
+ * through their own paths, which give the same packets as the generic
+ * one.
+ */
+#define LBP_BAND_BLANK	0	/* a single byte value */
+#define LBP_BAND_SPARSE	1	/* mostly runs */
+#define LBP_BAND_DENSE	2	/* mostly literal packets */
+#define LBP_BAND_CLASSES 3
+
+struct lbp_encoder
+{
+	int (*flush) (void *arg, const unsigned char *pkts, int count,
+		      int truncated);
+	void *arg;
+	int count;	/* packets waiting in pkts */
+	int packets;	/* packets of the current band */
+	int error;	/* a flush failed */
+	int generic;	/* the plain loop for every band, counted as dense */
+	int band_class;	/* LBP_BAND_* of the last band */
+	unsigned char pkts[MAX_PACKET_COUNT * 4];
+};
+
+/* Port backend, port is one of DATA, STATUS and CONTROL */
+struct lbp_port
+{
+	void (*out) (void *priv, int value, int port);
+	int (*in) (void *priv, int port);
+	void (*outs) (void *priv, const unsigned char *buf, int len); /* to DATA */
+	void *priv;
+};
+
+/* Recording backend state */
+struct lbp_record
+{
+	FILE *f;
+	int ctrl;
+};
+
+/* Compressed page fed to the transport. read() gets the size word of
+ * the next chunk and its packets (skipped if pkts is NULL). It returns
+ * 1, 0 at the end of the page, or -1 on error.
+ */
+struct lbp_chunks
+{
+	int (*read) (void *arg, int *size, unsigned char *pkts);
+	void *arg;
+};
+
+/* Transport. Set up by lbp_transport_init(), the fields up to logarg
+ * may be changed afterwards.
+ */
+struct lbp_transport
+{
+	const struct lbp_printer *prt;
+	struct lbp_port port;
+	int burst;	/* send band data with string I/O */
+	int deferred;	/* deferred verification policy */
+	int timed;	/* record the sleeps in lat */
+	void (*log) (void *arg, const char *fmt, va_list args);
+	void *logarg;
+
+	long io;	/* port accesses */
+	long saved;	/* readbacks skipped, net of the checks */
+	int bands;	/* bands sent of the current page */
+	struct lbp_latency lat;
+	struct lbp_fit fit;
+	struct
+	{
+		long time;
+		long io;
+		long slept;
+	} waited;	/* waits of the current page */
+
+	int ctrl_last;
+	int handshake;	/* in a band handshake, checked strictly */
+	struct
+	{
+		int count;
+		const char *where; /* first wrong status */
+		int stat;
+		int status;
+		int mask;
+	} check_log;
+	jmp_buf fail;
+	unsigned char pkts[MAX_PACKET_COUNT * 4];
+};
+
+const struct lbp_printer *lbp_get_printer (const char *name);
+
+void lbp_encoder_init (struct lbp_encoder *enc,
+		       int (*flush) (void *, const unsigned char *, int, int),
+		       void *arg);
+int lbp_classify_band (const unsigned char *band, int len);
+int lbp_encode_band (struct lbp_encoder *enc, const unsigned char *band, int len);
+int lbp_decode_packets (const unsigned char *in, int count,
+			unsigned char *out, int room);
+
+int lbp_direct_port (struct lbp_port *port);
+void lbp_record_port (struct lbp_port *port, struct lbp_record *rec, FILE *f);
+
+void lbp_transport_init (struct lbp_transport *tp,
+			 const struct lbp_printer *prt,
+			 const struct lbp_port *port);
+int lbp_reset (struct lbp_transport *tp);
+int lbp_probe (struct lbp_transport *tp);
+int lbp_print_page (struct lbp_transport *tp, struct lbp_chunks *src, int page);
+
+void lbp_estimate_page (const struct lbp_printer *prt, int deferred,
+			struct lbp_chunks *src, struct lbp_estimate *est);
+long lbp_est_time (const struct lbp_printer *prt,
+		   const struct lbp_estimate *est);
+int lbp_fit_cost (const struct lbp_fit *fit, struct lbp_cost *cost);
+
 /* end of file */
 
@@ -0,0 +1,1535 @@
+/*
+ *  Printer driver for Canon LBP-660 laser printer, library
+ *  Copyright (C) 2004 Nicolas Boichat <nicolas@boichat.ch>
+ *
+ *  Adapted from a printer driver for Samsung ML-85G laser printer
+ *  (C) Copyleft, 2000 Rildo Pragana <rpragana@acm.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <sys/io.h> /* for outb() and inb() */
+#include <sys/time.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h> /* needed for ioperm() */
+
+#include "lbp660.h"
+
+#define LBP_DEFAULT_TIMING {	\
+	.cmd = 1,		\
+	.data = 10,		\
+	.check = 15,		\
+	.init = 1,		\
+	.trailer = 3000,	\
+	.reset_status = 150,	\
+	.reset_step = 40,	\
+	.reset_flush = 500,	\
+}
+
+static const struct lbp_printer printers[] = {
+	{
+		.name = "LBP-460",
+		.lines_by_page = LINES_BY_PAGE460,
+		.cost = {
+			.port_io = 1,
+			.sleep_slack = 55,
+			.band_ready = 280000,
+			.paper_feed = 2500000,
+			.reset = 3200000,
+		},
+		.timing = LBP_DEFAULT_TIMING,
+	}, {
+		.name = "LBP-660",
+		.lines_by_page = LINES_BY_PAGE660,
+		.cost = {
+			.port_io = 1,
+			.sleep_slack = 55,
+			.band_ready = 120000,
+			.paper_feed = 2500000,
+			.reset = 3200000,
+		},
+		.timing = LBP_DEFAULT_TIMING,
+	}, {
+		NULL
+	}
+};
+
+static const int pagedata[] =
+{
+	-1, 0x89, /*100*/
+	-1, 0x8a, /*172*/
+	-1, 0x8b, /*244*/
+	-3, 0x8b, 0x89, 0x8c, /*333*/
+	-7, 0x8c, 0x4, 0x94, 0x3f, 0x95, 0x58, 0x94, /*456*/
+	-1, 0x95, /*528*/
+	-1, 0x89, /*600*/
+	-1, 0x8a, /*672*/
+	-1, 0x8b, /*744*/
+	-1, 0x89, /*816*/
+	-1, 0x8a, /*888*/
+	-1, 0x8b, /*960*/
+	-3, 0x8b, 0x89, 0x90, /*1049*/
+	-5, 0x91, 0x0, 0x90, 0x0, 0x89, /*1155*/
+	-1, 0x8a, /*1227*/
+	-1, 0x8b, /*1299*/
+	-1, 0x89, /*1372*/
+	-1, 0x8a, /*1444*/
+	-3, 0x8d, 0xa7, 0x8b, /*1533*/
+	-3, 0x8b, 0x8a, 0x90, /*1622*/
+	-3, 0x90, 0x8, 0x89, /*1712*/
+	-1, 0x8a, /*1784*/
+	-1, 0x8e, /*1856*/
+	-1, 0x90, /*1928*/
+	-3, 0x90, 0x9, 0x89, /*2018*/
+	-1, 0x8a, /*2090*/
+	-3, 0x8d, 0x40, 0x90, /*2179*/
+	-5, 0x90, 0xc9, 0xa0, 0x0, 0xa0, /*2285*/
+	-17, 0x81, 0xdc, 0x82, 0x0, 0x83, 0x61, 0x84, 0x0, 0x85,
+	0x58, 0x86, 0x2, 0x87, 0x9c, 0x88, 0x1a, 0x81, /*2493*/
+	-1, 0x82, /*2565*/
+	-1, 0x83, /*2637*/
+	-1, 0x84, /*2709*/
+	-1, 0x85, /*2781*/
+	-1, 0x86, /*2853*/
+	-1, 0x87, /*2925*/
+	-1, 0x88, /*2997*/
+	-1, 0x89, /*3070*/
+	-1, 0x8a, /*3142*/
+	-1, 0x8e, /*3214*/
+	-1, 0x89, /*3287*/
+	-1, 0x8a, /*3359*/
+	-3, 0x8d, 0x2, 0x89, /*3449*/
+	-1, 0x8a, /*3521*/
+	-1, 0x8e, /*3593*/
+	-1, 0x89, /*3666*/
+	-1, 0x8a, /*3738*/
+	-3, 0x8d, 0x9d, 0x89, /*3828*/
+	-1, 0x8a, /*3900*/
+	-1, 0x8e, /*3972*/
+	-1, 0x89, /*4045*/
+	-1, 0x8a, /*4117*/
+	-3, 0x8d, 0x2, 0x89, /*4207*/
+	-1, 0x8a, /*4279*/
+	-1, 0x8e, /*4351*/
+	-3, 0x93, 0x0, 0x89, /*4441*/
+	-1, 0x8a, /*4513*/
+	-3, 0x8d, 0x2, 0x89, /*4603*/
+	-1, 0x8a, /*4675*/
+	-1, 0x8e, /*4747*/
+	-1, 0x89, /*4820*/
+	-1, 0x8a, /*4892*/
+	-1, 0x89, /*4965*/
+	-1, 0x8a,
+	-256,
+	-260 }; //, /*5037*/
+
+static const int bandinit[] =
+{
+	-1, 0x8a, /*25157*/
+	-1, 0x8e, /*25229*/
+	-1, 0x89, /*25302*/
+	-1, 0x8a, /*25374*/
+	-1, 0x89, /*25447*/
+	-1, 0x8a, /*25519*/
+	-3, 0x8d, 0x1, 0x89, /*25609*/
+	-1, 0x8a, /*25681*/
+	-1, 0x89, /*25754*/
+	-1, 0x8a, /*25826*/
+	//-3, 0x80, 0xff, 0x7f, /*25909*/
+	-256, /* data */
+	-260
+};
+
+const struct lbp_printer *lbp_get_printer (const char *name)
+{
+	int i;
+	for (i = 0; printers[i].name; i++)
+		if (strcmp (printers[i].name, name) == 0)
+			return &printers[i];
+	return NULL;
+}
+
+/* Encoder, from the Rildo Pragana compressor */
+
+static const unsigned char parity[] =
+{
+	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
+	1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
+	1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
+	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0
+};
+
+static void out_packet (struct lbp_encoder *enc, int rle,
+			unsigned char a, unsigned char b, unsigned char c)
+{
+	union pkt1 pk1;
+	union pkt2 pk2;
+	union pkt3 pk3;
+	union pkt4 pk4;
+	unsigned char *p;
+
+	if ((rle == 2) || (enc->count == MAX_PACKET_COUNT))
+	{ // flush packet storage, truncated band if full before the end
+		if (enc->flush (enc->arg, enc->pkts, enc->count, rle != 2))
+			enc->error = 1;
+		enc->count = 0;
+		if (rle == 2)
+			return;
+	}
+
+	pk1.bits.t = 0;
+	pk2.bits.t = 1;
+	pk3.bits.t = 0;
+	pk4.bits.t = 1;
+	pk1.bits.rle = rle;
+	pk1.bits.al = a & 0x3f;
+	pk2.bits.ah = (a >> 6) & 0x3;
+	pk2.bits.bl = b & 0xf;
+	pk3.bits.bh = (b >> 4) & 0xf;
+	pk3.bits.cl = c & 0x3;
+	pk4.bits.ch = (c >> 2) & 0x3f;
+	pk2.bits.pa = parity[pk2.c & 0x3f];
+	pk3.bits.pa = parity[pk3.c & 0x3f] ^ 1;
+	pk4.bits.pa = parity[pk4.c & 0x3f];
+	p = enc->pkts + enc->count * 4;
+	p[0] = pk1.c;
+	p[1] = pk2.c;
+	p[2] = pk3.c;
+	p[3] = pk4.c;
+	enc->count++;
+	enc->packets++;
+}
+
+void lbp_encoder_init (struct lbp_encoder *enc,
+		       int (*flush) (void *, const unsigned char *, int, int),
+		       void *arg)
+{
+	enc->flush = flush;
+	enc->arg = arg;
+	enc->count = 0;
+	enc->packets = 0;
+	enc->error = 0;
+	enc->generic = 0;
+	enc->band_class = LBP_BAND_BLANK;
+}
+
+/* Run of pcnt times c1, followed by c2. Runs too long for one packet
+ * are split, leaving at least 2 bytes for the last packet.
+ */
+static INLINE void out_run (struct lbp_encoder *enc, int pcnt,
+			    unsigned char c1, unsigned char c2)
+{
+	while (pcnt > 258)
+	{
+		out_packet (enc, 1, 255, c1, c1);
+		pcnt -= 257;
+	}
+	/* one more if too large for one packet */
+	if (pcnt > 256)
+	{
+		out_packet (enc, 1, 253, c1, c1);
+		pcnt -= 255;
+	}
+	out_packet (enc, 1, (pcnt - 1), c1, c2);
+}
+
+/* Literal packet, the same as out_packet (enc, 0, a, b, c) */
+static INLINE void out_literal (struct lbp_encoder *enc, unsigned char a,
+				unsigned char b, unsigned char c)
+{
+	unsigned char *p;
+	int v;
+
+	if (enc->count == MAX_PACKET_COUNT)
+	{
+		out_packet (enc, 0, a, b, c);
+		return;
+	}
+	p = enc->pkts + enc->count * 4;
+	p[0] = a & 0x3f;
+	v = (a >> 6) | ((b & 0xf) << 2);
+	p[1] = 0x80 | (parity[v] << 6) | v;
+	v = (b >> 4) | ((c & 0x3) << 4);
+	p[2] = ((parity[v] ^ 1) << 6) | v;
+	v = c >> 2;
+	p[3] = 0x80 | (parity[v] << 6) | v;
+	enc->count++;
+	enc->packets++;
+}
+
+/* Number of bytes equal to c from p, up to max */
+static INLINE int run_length (const unsigned char *p, unsigned char c, int max)
+{
+	unsigned long long w;
+	unsigned long long pattern = c * 0x0101010101010101ULL;
+	int n = 0;
+
+	while ((n + 8 <= max) && (memcpy (&w, p + n, 8), w == pattern))
+		n += 8;
+	while ((n < max) && (p[n] == c))
+		n++;
+	return n;
+}
+
+/* Classifies a band from samples of 8 bytes every 64: sparse if most
+ * sampled bytes repeat the one before or hardly any pixel is black,
+ * dense otherwise. Blank bands hold a single byte value.
+ */
+int lbp_classify_band (const unsigned char *band, int len)
+{
+	unsigned long long w;
+	int repeats = 0;
+	int black = 0;
+	int pairs = 0;
+	int i, j;
+
+	if (run_length (band, band[0], len) == len)
+		return LBP_BAND_BLANK;
+	for (i = 0; i + 8 <= len; i += 64)
+	{
+		memcpy (&w, band + i, 8);
+		black += __builtin_popcountll (w);
+		for (j = 1; j < 8; j++)
+			repeats += band[i + j] == band[i + j - 1];
+		pairs += 7;
+	}
+	if ((2 * repeats >= pairs) || (16 * black < 8 * 8 * pairs / 7))
+		return LBP_BAND_SPARSE;
+	return LBP_BAND_DENSE;
+}
+
+/* The compressor. skip scans the runs a word at a time, batch sends the
+ * literal packets in a tight loop. Both give the same packets.
+ */
+static INLINE void encode (struct lbp_encoder *enc, const unsigned char *band,
+			   int len, int skip, int batch)
+{
+	const unsigned char *p = band;
+	unsigned char c1, c2, c3;
+	int cnt;			/* count of characters left in the band */
+	int pcnt;			/* count of chars for each packet */
+	int n;
+
+	c1 = *p++;
+	c2 = *p++;
+	cnt = len;
+	pcnt = 1;
+
+	while (cnt)
+	{
+		if ((c1 == c2) && (cnt > 2))
+		{
+			if (skip)
+			{ /* c2 is p[-1], stop with 2 bytes left like below */
+				n = run_length (p - 1, c1, cnt - 2);
+				pcnt += n;
+				cnt -= n;
+				p += n;
+				c2 = p[-1];
+				continue;
+			}
+			pcnt++;
+			c2 = *p++;
+			cnt--;
+			continue;
+		}
+		if (cnt==2)
+		{
+			/* leave at least 2 bytes */
+			out_run (enc, pcnt, c1, c2);
+			break;
+		}
+		if ((cnt == 3) || (cnt == 4))
+		{
+			if (pcnt > 1)
+			{
+				out_run (enc, pcnt - 1, c1, c1);
+				c3 = *p++;
+				if (cnt == 3)
+				{
+					out_packet (enc, 1, 0, c2, c3);
+				} else {
+					c1 = *p++;
+					out_packet (enc, 0, c2, c3, c1);
+				}
+			} else {
+				c3 = *p++;
+				if (cnt == 3)
+				{
+					out_packet (enc, 0, c1, c2, c3);
+				} else {
+					out_packet (enc, 1, 0, c1, c2);
+					c1 = *p++;
+					out_packet (enc, 1, 0, c3, c1);
+				}
+			}
+			break;
+		}
+		if (pcnt>1)
+		{
+			out_run (enc, pcnt, c1, c2);
+			pcnt = 1;
+			c1 = *p++;
+			c2 = *p++;
+			cnt -= 2;
+		} else if (batch) {
+			/* literals as long as no run starts */
+			do
+			{
+				c3 = *p++;
+				out_literal (enc, c1, c2, c3);
+				c1 = *p++;
+				c2 = *p++;
+				cnt -= 3;
+			} while ((cnt > 4) && (c1 != c2));
+		} else {
+			c3 = *p++;
+			out_packet (enc, 0, c1, c2, c3);
+			c1 = *p++;
+			c2 = *p++;
+			cnt -= 3;
+		}
+	}
+}
+
+/* Compresses the first len bytes of band, at least 2. Returns the
+ * number of packets, or -1 if a flush failed.
+ */
+int lbp_encode_band (struct lbp_encoder *enc, const unsigned char *band, int len)
+{
+	enc->packets = 0;
+	if (enc->generic)
+	{
+		enc->band_class = LBP_BAND_DENSE;
+		encode (enc, band, len, 0, 0);
+	} else {
+		enc->band_class = lbp_classify_band (band, len);
+		switch (enc->band_class)
+		{
+		case LBP_BAND_BLANK:
+			/* what the loop ends with */
+			out_run (enc, len - 1, band[0], band[len - 1]);
+			break;
+		case LBP_BAND_SPARSE:
+			encode (enc, band, len, 1, 0);
+			break;
+		default:
+			encode (enc, band, len, 0, 1);
+		}
+	}
+	out_packet (enc, 2, 0, 0, 0);
+	return enc->error ? -1 : enc->packets;
+}
+
+/* Reference decoder for the packets written by out_packet().
+ * A run packet (rle = 1) stands for a + 1 times b followed by c,
+ * a literal packet for the three bytes a, b and c.
+ * Returns the number of bytes written to out, or -1 if a packet is
+ * malformed or would overflow out.
+ */
+int lbp_decode_packets (const unsigned char *in, int count,
+			unsigned char *out, int room)
+{
+	unsigned char *p = out;
+	unsigned char *end = out + room;
+	unsigned int a, b, c;
+
+	for (; count; count--, in += 4)
+	{
+		if (((in[0] & 0x80) != 0) || ((in[1] & 0x80) == 0)
+		    || ((in[2] & 0x80) != 0) || ((in[3] & 0x80) == 0))
+			return -1;
+		if ((((in[1] >> 6) & 1) != parity[in[1] & 0x3f])
+		    || (((in[2] >> 6) & 1) != (parity[in[2] & 0x3f] ^ 1))
+		    || (((in[3] >> 6) & 1) != parity[in[3] & 0x3f]))
+			return -1;
+
+		a = (in[0] & 0x3f) | ((in[1] & 0x3) << 6);
+		b = ((in[1] >> 2) & 0xf) | ((in[2] & 0xf) << 4);
+		c = ((in[2] >> 4) & 0x3) | ((in[3] & 0x3f) << 2);
+
+		if (in[0] & 0x40)
+		{
+			if (end - p < a + 2)
+				return -1;
+			memset (p, b, a + 1);
+			p += a + 1;
+			*p++ = c;
+		} else {
+			if (end - p < 3)
+				return -1;
+			p[0] = a;
+			p[1] = b;
+			p[2] = c;
+			p += 3;
+		}
+	}
+	return p - out;
+}
+
+/* Transport */
+
+static long elapsed (struct timeval *from)
+{
+	struct timeval now;
+	gettimeofday (&now, NULL);
+	return (now.tv_usec - from->tv_usec)
+		+ ((now.tv_sec - from->tv_sec) * 1000000);
+}
+
+static void tmessage (struct lbp_transport *tp, const char *fmt, ...)
+{
+	va_list args;
+	va_start (args, fmt);
+	if (tp->log)
+		tp->log (tp->logarg, fmt, args);
+	else
+		vfprintf (stderr, fmt, args);
+	va_end (args);
+}
+
+/* Leaves the current lbp_* call, which returns -1 */
+static void fail (struct lbp_transport *tp)
+{
+	longjmp (tp->fail, 1);
+}
+
+static void tdelay (struct lbp_transport *tp, int usec)
+{
+	struct timeval tv;
+	long t, late;
+
+	gettimeofday (&tv, NULL);
+	usleep (usec);
+	t = elapsed (&tv);
+	tp->fit.sleep += usec;
+	tp->fit.sleeps++;
+	tp->fit.slept += t;
+	if (!tp->timed)
+		return;
+	late = t - usec;
+	tp->lat.sleeps++;
+	tp->lat.total += late;
+	if (late > tp->lat.max)
+		tp->lat.max = late;
+	if (late > RT_DEADLINE)
+		tp->lat.misses++;
+}
+
+/* Time, port accesses and sleeps since a point of the transport */
+struct span
+{
+	struct timeval tv;
+	long io;
+	long slept;
+};
+
+static void span_begin (struct lbp_transport *tp, struct span *w)
+{
+	gettimeofday (&w->tv, NULL);
+	w->io = tp->io;
+	w->slept = tp->fit.slept;
+}
+
+/* Ends a wait for the printer, kept out of the busy time of the page.
+ * Returns the usec waited.
+ */
+static long wait_end (struct lbp_transport *tp, struct span *w)
+{
+	long t = elapsed (&w->tv);
+	tp->waited.time += t;
+	tp->waited.io += tp->io - w->io;
+	tp->waited.slept += tp->fit.slept - w->slept;
+	return t;
+}
+
+/* Port backends */
+
+static void direct_out (void *priv, int value, int port)
+{
+	outb (value, port);
+}
+
+static int direct_in (void *priv, int port)
+{
+	return inb (port);
+}
+
+static void direct_outs (void *priv, const unsigned char *buf, int len)
+{
+	outsb (DATA, buf, len);
+}
+
+/* Returns -1 without access to the ports (not root) */
+int lbp_direct_port (struct lbp_port *port)
+{
+	if (ioperm (DATA, 3, 1))
+		return -1;
+	port->out = direct_out;
+	port->in = direct_in;
+	port->outs = direct_outs;
+	port->priv = NULL;
+	return 0;
+}
+
+/* Records every port access to a file, one per line: "D xx" and
+ * "C xx" for writes, "s xx" and "c xx" for reads, and "B len xx..."
+ * for a block written with string I/O. Reads answer like a printer
+ * that is always ready: the control register reads back what was
+ * written, the status follows bit 2 of it. This is enough for
+ * lbp_print_page(), not for lbp_reset().
+ */
+static void record_out (void *priv, int value, int port)
+{
+	struct lbp_record *rec = priv;
+	if (port == CONTROL)
+		rec->ctrl = value;
+	fprintf (rec->f, "%c %02x\n", port == DATA ? 'D' : 'C', value & 0xff);
+}
+
+static int record_in (void *priv, int port)
+{
+	struct lbp_record *rec = priv;
+	int value;
+	if (port == CONTROL)
+		value = 0xc0 | (rec->ctrl & 0x1f);
+	else
+		value = (rec->ctrl & 0x04) ? 0x78 : 0x48;
+	fprintf (rec->f, "%c %02x\n", port == CONTROL ? 'c' : 's', value);
+	return value;
+}
+
+static void record_outs (void *priv, const unsigned char *buf, int len)
+{
+	struct lbp_record *rec = priv;
+	fprintf (rec->f, "B %d ", len);
+	while (len--)
+		fprintf (rec->f, "%02x", *buf++);
+	putc ('\n', rec->f);
+}
+
+void lbp_record_port (struct lbp_port *port, struct lbp_record *rec, FILE *f)
+{
+	rec->f = f;
+	rec->ctrl = 0;
+	port->out = record_out;
+	port->in = record_in;
+	port->outs = record_outs;
+	port->priv = rec;
+}
+
+/* Verification policy. The strict one reads the control register back
+ * after every command and stops on the first wrong status. The
+ * deferred one skips these readbacks and only counts wrong statuses;
+ * check_deferred() fails on them at band boundaries. Only the last
+ * command is read back there: a command that did not latch before it
+ * goes unseen. The band handshakes (tp->handshake) stay strict.
+ */
+
+static INLINE void dataout (struct lbp_transport *tp, int data)
+{
+	tp->port.out (tp->port.priv, data, DATA);
+	tp->io++;
+}
+
+/* Sends a block of data, at once unless burst is off */
+static INLINE void dataouts (struct lbp_transport *tp, const unsigned char *buf, int len)
+{
+	if (tp->burst)
+	{
+		tp->port.outs (tp->port.priv, buf, len);
+		tp->io += len;
+		return;
+	}
+	while (len--)
+		dataout (tp, *buf++);
+}
+
+static INLINE void ctrlout (struct lbp_transport *tp, int cmd)
+{
+	tp->port.out (tp->port.priv, cmd, CONTROL);
+	tp->ctrl_last = cmd;
+	tp->io++;
+}
+
+static INLINE int ctrlin (struct lbp_transport *tp)
+{
+	tp->io++;
+	return tp->port.in (tp->port.priv, CONTROL);
+}
+
+static INLINE void checkctrl (struct lbp_transport *tp, int control)
+{
+	int ctrl = ctrlin (tp);
+	if ((ctrl & 0x1f) != (control & 0x1f))
+	{
+		TRACE3 (status_mismatch, ctrl, control, 0x1f);
+		tmessage (tp, "Error, wrong control : %x instead of %x\n", ctrl, control);
+		fail (tp);
+	}
+}
+
+static INLINE int statusin (struct lbp_transport *tp)
+{
+	tp->io++;
+	return tp->port.in (tp->port.priv, STATUS);
+}
+
+static INLINE void checkstatus (struct lbp_transport *tp, int status)
+{
+	int stat = statusin (tp);
+	if ((stat & 0xf8) != (status & 0xf8))
+	{
+		TRACE3 (status_mismatch, stat, status, 0xf8);
+		tmessage (tp, "Error, wrong status : %x instead of %x\n", stat, status);
+		fail (tp);
+	}
+}
+
+/* Readback after a command */
+static INLINE void cmdctrl (struct lbp_transport *tp, int cmd)
+{
+	if (tp->deferred && !tp->handshake)
+		tp->saved++;
+	else
+		checkctrl (tp, cmd);
+}
+
+/* Returns 1 if a wrong status is left for check_deferred() */
+static INLINE int defer_status (struct lbp_transport *tp, const char *where, int stat, int status, int mask)
+{
+	TRACE3 (status_mismatch, stat, status, mask);
+	if (!tp->deferred || tp->handshake)
+		return 0;
+	if (!tp->check_log.count++)
+	{
+		tp->check_log.where = where;
+		tp->check_log.stat = stat;
+		tp->check_log.status = status;
+		tp->check_log.mask = mask;
+	}
+	return 1;
+}
+
+static INLINE int cmdout (struct lbp_transport *tp, int cmd)
+{
+	int stat;
+	ctrlout (tp, cmd);
+	tdelay (tp, tp->prt->timing.cmd);
+	stat = statusin (tp);
+	cmdctrl (tp, cmd);
+	return stat;
+}
+
+static INLINE void checkcmdout (struct lbp_transport *tp, int cmd, int status, int mask)
+{
+	int stat = cmdout (tp, cmd);
+	if (((stat & mask) != (status & mask))
+	    && !defer_status (tp, "checkcmdout", stat, status, mask))
+	{
+		tmessage (tp, "Error, wrong status (checkcmdout) :"
+			 " %x instead of %x (mask : %x)\n", stat, status, mask);
+		fail (tp);
+	}
+}
+
+static INLINE int cmddataouts (struct lbp_transport *tp, int cmd, int data, int sleep)
+{
+	int stat;
+	ctrlout (tp, cmd);
+	tdelay (tp, sleep);
+	stat = statusin (tp);
+	dataout (tp, data);
+	cmdctrl (tp, cmd);
+	return stat;
+}
+
+static INLINE void cmddataout (struct lbp_transport *tp, int cmd, int data)
+{
+	cmddataouts (tp, cmd, data, tp->prt->timing.data);
+}
+
+static INLINE void checkcmddataouts (struct lbp_transport *tp, int cmd, int data, int status, int mask, int sleep)
+{
+	int stat = cmddataouts (tp, cmd, data, sleep);
+	if (((stat & mask) != (status & mask))
+	    && !defer_status (tp, "checkcmddataout", stat, status, mask))
+	{
+		tmessage (tp, "Error, wrong status (checkcmddataout) :"
+			 " %x instead of %x (mask : %x)\n", stat, status, mask);
+		fail (tp);
+	}
+}
+
+static INLINE void checkcmddataout (struct lbp_transport *tp, int cmd, int data, int status, int mask)
+{
+	checkcmddataouts (tp, cmd, data, status, mask, tp->prt->timing.check);
+}
+
+/* Band boundary: reads back the last command, and fails on the wrong
+ * statuses since the last boundary
+ */
+static void check_deferred (struct lbp_transport *tp)
+{
+	if (!tp->deferred)
+		return;
+	checkctrl (tp, tp->ctrl_last);
+	tp->saved--;
+	if (tp->check_log.count)
+	{
+		tmessage (tp, "Error, wrong status (%s) : %x instead of %x (mask : %x), "
+			 "%d wrong statuses\n", tp->check_log.where, tp->check_log.stat,
+			 tp->check_log.status, tp->check_log.mask, tp->check_log.count);
+		fail (tp);
+	}
+}
+
+static INLINE void data6out (struct lbp_transport *tp, int data)
+{
+	// Must be : cmdout (2, 4[e6])
+	checkcmddataout (tp, 0x06, data, 0x70, 0x70);
+	ctrlout (tp, 0x06);
+	tdelay (tp, tp->prt->timing.data);
+	checkcmdout (tp, 0x7, 0x70, 0x70);
+	checkcmdout (tp, 0x6, 0x70, 0x70);
+	ctrlout (tp, 0x06);
+}
+
+static INLINE void data64out (struct lbp_transport *tp, const int *data, int start, int end)
+{
+	int i;
+	// Must be : cmdout (2, 4[e6])
+	checkcmddataout (tp, 0x06, data[start], 0x70, 0x70);
+	for (i = start + 1; i < end; i += 2)
+	{
+		ctrlout (tp, 0x06);
+		checkcmdout (tp, 0x07, 0x70, 0x70);
+		checkcmddataout (tp, 0x06, data[i], 0x70, 0x70);
+
+		ctrlout (tp, 0x04);
+		checkcmdout (tp, 0x05, 0x70, 0x70);
+		checkcmddataout (tp, 0x04, data[i + 1], 0x70, 0x70);
+	}
+	ctrlout (tp, 0x06);
+	checkcmdout (tp, 0x7, 0x70, 0x70);
+	checkcmdout (tp, 0x6, 0x70, 0x70);
+	ctrlout (tp, 0x06);
+}
+
+/* band : index of the band
+ * size : size of the band
+ * type : 0 : classic
+ *        1 : rest of a truncated band, after a quick init
+ * white : should we send only a white band ?
+ * timeout : should we timeout (1), or wait for paper forever (0)
+ */
+static int print_band (struct lbp_transport *tp, int band, int size, int type,
+		       int white, int timeout)
+{
+	const struct lbp_timing *tm = &tp->prt->timing;
+	unsigned char whiteband[971];
+	struct span w;
+	long t;
+	int i;
+	int ret;
+
+	check_deferred (tp);
+	tp->handshake = 1;
+
+	tmessage (tp, "Initing band(%d - %d - %d - %d - %d)...\n",
+		 band, size, type, white, timeout);
+
+	if (type == 1)
+	{ // Quick init (band truncated)
+		checkcmddataouts (tp, 0x04, 0xff, 0x70, 0x70, tm->init);
+	} else { //Normal init
+		ctrlout (tp, 0x02);
+		checkctrl (tp, 0xc2);
+		checkcmddataouts (tp, 0x06, 0x80, 0x70, 0x70, tm->init);
+		checkcmdout (tp, 0x07, 0x70, 0x70);
+		checkcmddataouts (tp, 0x06, 0xff, 0x70, 0x70, tm->init);
+	}
+	ctrlout (tp, 0x04);
+	ctrlout (tp, 0x05);
+
+	tmessage (tp, "Waiting for ready status...\n");
+	TRACE1 (band_wait_start, band);
+	span_begin (tp, &w);
+	statusin (tp);
+	if (((ret = statusin (tp)) & 0xf0) != 0x70)
+	{
+		struct timeval ltv; /* Begin time */
+		struct timeval itv; /* Last init time */
+		struct timeval ntv; /* Current time */
+		gettimeofday (&ltv, NULL);
+		gettimeofday (&itv, NULL);
+		do
+		{
+			tmessage (tp, "%x ", ret);
+			tdelay (tp, 1);
+			gettimeofday (&ntv, NULL);
+			if (((ntv.tv_usec - itv.tv_usec)
+			     + ((ntv.tv_sec - itv.tv_sec) * 1000000)) > 1000000)
+			{ // Reinit every second
+				tmessage (tp, "Reiniting band...\n");
+				statusin (tp);
+				if (type == 1)
+				{ // Quick init (band truncated)
+					checkcmddataouts (tp, 0x04, 0xff, 0x70, 0x70, tm->init);
+				} else { //Normal init
+					ctrlout (tp, 0x02);
+					checkctrl (tp, 0xc2);
+					checkcmddataouts (tp, 0x06, 0x80, 0x70, 0x70, tm->init);
+					//      ctrlout (tp, 0x06);
+					checkcmdout (tp, 0x07, 0x70, 0x70);
+					checkcmddataouts (tp, 0x06, 0xff, 0x70, 0x70, tm->init);
+				}
+				ctrlout (tp, 0x04);
+				ctrlout (tp, 0x05);
+				gettimeofday (&itv, NULL);
+			}
+			if (((ntv.tv_usec - ltv.tv_usec)
+			     + ((ntv.tv_sec - ltv.tv_sec) * 1000000)) > 15000000)
+			{ // 15 seconds timeout
+				if (timeout)
+				{
+					tmessage (tp, "Band initialisation failed (0x%x)\n",
+						 statusin (tp));
+					tp->handshake = 0;
+					return 0;
+				} else {
+					tmessage (tp, "Waiting for paper... (0x%x)\n",
+						 statusin (tp));
+					while (((ret = statusin (tp)) & 0xf0) == 0xF0)
+					{
+						gettimeofday (&ntv, NULL);
+						if (((ntv.tv_usec - ltv.tv_usec)
+						     + ((ntv.tv_sec - ltv.tv_sec) * 1000000))
+						    > 1800000000)
+						{ //30 minutes timeout
+						tmessage (tp, "Timed out waiting for paper. (0x%x)\n",
+							 statusin (tp));
+						tp->handshake = 0;
+						return 0;
+						}
+						tdelay (tp, 1);
+					}
+					timeout = 1;
+					gettimeofday (&ltv, NULL);
+				}
+			}
+		} while (((ret = statusin (tp)) & 0xf0) != 0x70);
+		tmessage (tp, "Band inited (0x%x, %lu)\n", statusin (tp),
+			 ((ntv.tv_usec - ltv.tv_usec) + ((ntv.tv_sec - ltv.tv_sec) * 1000000)));
+	} else {
+		tmessage (tp, "Band inited (0x%x, 0)\n", statusin (tp));
+	}
+	TRACE2 (band_wait_end, band, ret);
+	t = wait_end (tp, &w);
+	if (band)
+	{
+		tp->fit.ready += t;
+		tp->fit.readies++;
+	} else {
+		tp->fit.feed += t;
+		tp->fit.feeds++;
+	}
+
+	/* data */
+	TRACE2 (band_tx_start, band, size);
+
+	if (white)
+	{
+		for (i = 0; i < 242; i++)
+		{
+			whiteband[i * 4] = 0x7f;
+			whiteband[i * 4 + 1] = 0x83;
+			whiteband[i * 4 + 2] = 0x40;
+			whiteband[i * 4 + 3] = 0x80;
+		}
+		whiteband[968] = 0x4d;
+		whiteband[969] = 0x83;
+		whiteband[970] = 0x40;
+		dataouts (tp, whiteband, sizeof (whiteband));
+	} else {
+		dataouts (tp, tp->pkts, size * 4);
+	}
+	TRACE1 (band_tx_end, band);
+
+	checkctrl (tp, 0xc5);
+	checkcmddataouts (tp, 0x04, 0x89, 0x70, 0x70, tm->trailer);
+	ctrlout (tp, 0x06);
+	checkcmdout (tp, 0x07, 0x70, 0x70);
+	checkcmdout (tp, 0x06, 0x70, 0x70);
+	ctrlout (tp, 0x06);
+	tp->handshake = 0;
+
+	return ret;
+}
+
+static void reset_printer (struct lbp_transport *tp)
+{
+	static const unsigned char zeros[12287];
+	int i = 0;
+	int sig = 0;
+	int ret = 0;
+	int offset = 0;
+	const struct lbp_timing *tm = &tp->prt->timing;
+	struct span w;
+	long t;
+
+	span_begin (tp, &w);
+	TRACE0 (reset_start);
+	tmessage (tp, "Resetting %s...", tp->prt->name);
+	
+	dataout (tp, 0x24);
+	dataout (tp, 0x06);
+	tdelay (tp, 100);
+	
+	ctrlout (tp, 0x0a);
+	ctrlout (tp, 0x0a);
+	ctrlout (tp, 0x0e);
+	tdelay (tp, 1000000); //16
+	
+	dataout (tp, 0x24);
+	checkctrl (tp, 0xce);
+	ctrlout (tp, 0x06);
+	tdelay (tp, tm->reset_status); /* 100-250 */
+
+	{
+		int stat = statusin (tp);
+
+		switch (stat /*& 0xf8*/)
+		{
+			case 0x3e:
+				tmessage (tp, "ok\n");
+				break;
+			case 0x5e:
+				TRACE3 (status_mismatch, stat, 0x3e, 0xff);
+				tmessage (tp, "failed, check cables\n");
+				fail (tp);
+			default:
+				TRACE3 (status_mismatch, stat, 0x3e, 0xff);
+				tmessage (tp, "failed, error code 0x%x\n", stat);
+				fail (tp);
+		}
+	}
+
+	checkctrl (tp, 0xc6);
+	ctrlout (tp, 0x07);
+	ctrlout (tp, 0x07);
+	ctrlout (tp, 0x04);
+	tdelay (tp, tm->reset_step);
+	
+	checkstatus (tp, 0xde);
+	checkctrl (tp, 0xc4);
+	ctrlout (tp, 0x06);
+	tdelay (tp, tm->reset_step);
+	
+	checkstatus (tp, 0xfe);
+	tdelay (tp, 10);
+	
+	checkctrl (tp, 0xc6);
+	ctrlout (tp, 0x06);
+	sig = 0; /* true if a 5e has been received */
+	i = 0; /* 0e - 4e count */
+	while (1)
+	{
+		ret = cmdout (tp, 0x02) & 0xf8;
+		if (ret == 0x08)
+		{
+			i++;
+		} else if (ret == 0x18) {
+			i = 0;
+		} else {
+			TRACE3 (status_mismatch, ret, 0x08, 0xf8);
+			tmessage (tp, "Error, wrong status (init 2nd loop) :"
+				 " %x instead of 0x[01]8\n", ret);
+			fail (tp);
+		}
+
+		if (sig && (i == 21))
+			break;
+
+		ret = cmdout (tp, 0x00) & 0xf8;
+		if (ret == 0x48)
+		{
+			i++;
+		} else if (ret == 0x58) {
+			i = 0;
+			sig = 1;
+		} else {
+			TRACE3 (status_mismatch, ret, 0x48, 0xf8);
+			tmessage (tp, "Error, wrong status (init 2nd loop) :"
+				 " %x instead of 0x[45]8\n", ret);
+			fail (tp);
+		}
+	}
+
+	checkcmdout (tp, 0x06, 0x78, 0x78);
+	ctrlout (tp, 0x04);
+	checkcmdout (tp, 0x0c, 0x28, 0x78);
+	ctrlout (tp, 0x0c);
+	tdelay (tp, 15);
+	
+	dataout (tp, 0x20);
+	checkctrl (tp, 0xcc);
+	checkcmdout (tp, 0x06, 0x38, 0x78);
+	ctrlout (tp, 0x07);
+	ctrlout (tp, 0x07);
+	ctrlout (tp, 0x04);
+	tdelay (tp, tm->reset_step);
+	
+	checkstatus (tp, 0xde);
+	checkctrl (tp, 0xc4);
+	ctrlout (tp, 0x06);
+	tdelay (tp, tm->reset_step);
+	
+	checkstatus (tp, 0xfe);
+	sleep (2);
+
+	dataouts (tp, zeros, sizeof (zeros));
+
+	tdelay (tp, tm->reset_flush);
+	
+	checkstatus (tp, 0xfe);
+	dataout (tp, 0xa0);
+	checkctrl (tp, 0xc6);
+	ctrlout (tp, 0x06);
+	checkcmdout (tp, 0x07, 0x78, 0x78);
+	ctrlout (tp, 0x06);
+	tdelay (tp, 10);
+	
+	checkstatus (tp, 0xfe);
+	dataout (tp, 0x00);
+	checkctrl (tp, 0xc6);
+	ctrlout (tp, 0x04);
+	checkcmdout (tp, 0x05, 0x78, 0x78);
+	ctrlout (tp, 0x04);
+	tdelay (tp, 20);
+	
+	checkstatus (tp, 0xfe);
+	dataout (tp, 0xa0);
+	checkctrl (tp, 0xc4);
+	ctrlout (tp, 0x06);
+	checkcmdout (tp, 0x07, 0x78, 0x78);
+	checkcmdout (tp, 0x06, 0x78, 0x78);
+	ctrlout (tp, 0x06);
+	offset = 0;
+	check_deferred (tp);
+
+	TRACE0 (reset_end);
+	t = wait_end (tp, &w);
+	tp->fit.reset += t;
+	tp->fit.resets++;
+	tmessage (tp, "Printer reseted (%ld ms).\n", t / 1000);
+}
+
+/* Command of the probe, without failing: returns the status, or -1 if
+ * the control register does not read back the command.
+ */
+static int probe_cmd (struct lbp_transport *tp, int cmd)
+{
+	int stat;
+	ctrlout (tp, cmd);
+	tdelay (tp, tp->prt->timing.cmd);
+	stat = statusin (tp);
+	if ((ctrlin (tp) & 0x1f) != cmd)
+		return -1;
+	return stat;
+}
+
+/* Looks for an engine left initialised by a previous job: it answers
+ * the page handshake of print_page() at once, and the control register
+ * follows the commands. Returns 1 if so, the full reset_printer() can
+ * then be skipped. The time saved is estimated from the reset cost,
+ * which -M measures.
+ */
+static int probe_printer (struct lbp_transport *tp)
+{
+	int i;
+	int stat;
+	long t;
+	struct timeval tv;
+
+	gettimeofday (&tv, NULL);
+	for (i = 0; i < PROBE_READS; i++)
+	{
+		if ((probe_cmd (tp, 0) < 0)
+		    || ((stat = probe_cmd (tp, 2)) < 0)
+		    || ((stat & 0xf0) != 0x40))
+		{
+			tmessage (tp, "Printer not ready, resetting it.\n");
+			return 0;
+		}
+	}
+	t = elapsed (&tv);
+	tmessage (tp, "%s already initialised, reset skipped "
+		 "(about %ld ms saved).\n", tp->prt->name,
+		 (tp->prt->cost.reset - t) / 1000);
+	return 1;
+}
+
+/* Reads the next chunk into tp->pkts, returns 0 at the end of the page */
+static int next_chunk (struct lbp_transport *tp, struct lbp_chunks *src,
+		       int *size)
+{
+	int ret = src->read (src->arg, size, tp->pkts);
+	if (ret < 0)
+	{
+		tmessage (tp, "Can't read band %d\n", tp->bands);
+		fail (tp);
+	}
+	return ret;
+}
+
+static int print_page (struct lbp_transport *tp, struct lbp_chunks *src, int page)
+{
+	int i = 0;
+	int inited = 0; // 0: the printer is not ready,
+			// 1: started to init the page,
+			// 2: started to print (there is paper)
+	int ret = 0;
+	int offset = 0;
+	int len = 0;
+	int size;
+
+	const int *data = pagedata;
+
+	struct timeval printinittv;
+	struct timeval printnewtv;
+	struct span w;
+
+	long io = tp->io;
+	long saved = tp->saved;
+
+	span_begin (tp, &w);
+	memset (&tp->waited, 0, sizeof (tp->waited));
+
+	tmessage (tp, "Sending page...\n");
+	TRACE1 (page_start, page);
+	i = 0; //Band counter
+	tp->bands = 0;
+
+	gettimeofday (&printinittv, NULL);
+
+	while (1)
+	{
+		ret = cmdout (tp, 0);
+		if (!inited)
+		{
+			gettimeofday (&printnewtv, NULL);
+			if ((printnewtv.tv_sec - printinittv.tv_sec) > 3)
+			{
+				reset_printer (tp);
+				gettimeofday (&printinittv, NULL);
+			}
+		}
+
+		if ((cmdout (tp, 2) & 0xf0) == 0x40)
+		{ //0x40 or 0x48
+			if (!inited)
+				inited = 1;
+
+			len = -data[offset];
+			if (len == 260)
+			{
+				offset = 0;
+				data = bandinit;
+			} else if (len > 255) {
+				int type = len - 256;
+				int timeout = (inited - 1) || (i == 0);
+
+				tmessage (tp, "Sending band %d...\n", i);
+				if (! next_chunk (tp, src, &size))
+					break;
+				/* a truncated band goes on in the next chunks,
+				 * sent right away after a quick init */
+				while (1)
+				{
+					if ((size & 0xFFFF) || (type == 0))
+					{
+						ret = print_band (tp, i, size & 0xFFFF,
+								  type, 0, timeout);
+						if (!ret)
+						{
+							TRACE2 (page_end, page, 0);
+							return 0;
+						}
+						else if ((ret & 0xf0) != 0x70)
+							inited = 2;
+					}
+					if (!(size & 0x10000))
+						break;
+					if (! next_chunk (tp, src, &size))
+					{
+						tmessage (tp, "Band %d truncated at "
+							 "the end of the page\n", i);
+						fail (tp);
+					}
+					type = 1;
+					timeout = 1;
+				}
+				offset++;
+
+				i++;
+				tp->bands = i;
+			} else if (len > 1) {
+				if (data[offset + 2] == -1)
+				{
+					int seg[17];
+
+					memcpy (seg, data + offset + 1, len * sizeof (int));
+					seg[1] = (i % 2) + 1;
+					data64out (tp, seg, 0, len);
+				} else {
+					data64out (tp, data, offset + 1, offset + 1 + len);
+				}
+				offset += len + 1;
+			} else {
+				data6out (tp, data[offset + 1]);
+				offset += 2;
+			}
+		}
+	}
+	check_deferred (tp);
+	TRACE2 (page_end, page, 1);
+	/* the whole page less its waits and sleeps */
+	tp->fit.busy += elapsed (&w.tv) - tp->waited.time
+		- (tp->fit.slept - w.slept - tp->waited.slept);
+	tp->fit.busy_io += tp->io - w.io - tp->waited.io;
+	tp->fit.pages++;
+	tmessage (tp, "OK (%ld port accesses, %ld readbacks saved)\n",
+		 tp->io - io, tp->saved - saved);
+	return 1;
+}
+
+
+void lbp_transport_init (struct lbp_transport *tp,
+			 const struct lbp_printer *prt,
+			 const struct lbp_port *port)
+{
+	memset (tp, 0, sizeof (*tp));
+	tp->prt = prt;
+	if (port)
+		tp->port = *port;
+	tp->burst = 1;
+}
+
+/* Entry points: a failed check leaves them through fail() */
+
+int lbp_reset (struct lbp_transport *tp)
+{
+	if (setjmp (tp->fail))
+		return -1;
+	tp->check_log.count = 0;
+	tp->handshake = 0;
+	reset_printer (tp);
+	return 0;
+}
+
+int lbp_probe (struct lbp_transport *tp)
+{
+	if (setjmp (tp->fail))
+		return -1;
+	tp->check_log.count = 0;
+	tp->handshake = 0;
+	return probe_printer (tp);
+}
+
+/* Returns 1 once the page is printed, 0 if a band could not be started
+ * (the page may be sent again after lbp_reset()), or -1 on error.
+ */
+int lbp_print_page (struct lbp_transport *tp, struct lbp_chunks *src, int page)
+{
+	if (setjmp (tp->fail))
+		return -1;
+	tp->check_log.count = 0;
+	tp->handshake = 0;
+	return print_page (tp, src, page);
+}
+
+/* Dry-run cost model, mirrors the helpers above step by step */
+
+static void est_cmdout (const struct lbp_timing *tm, struct lbp_estimate *est,
+			int deferred)
+{
+	est->io += deferred ? 2 : 3;
+	est->sleep += tm->cmd;
+	est->sleeps++;
+}
+
+static void est_cmddataouts (struct lbp_estimate *est, int deferred, int sleep)
+{
+	est->io += deferred ? 3 : 4;
+	est->wire++;
+	est->sleep += sleep;
+	est->sleeps++;
+}
+
+static void est_data6out (const struct lbp_timing *tm,
+			 struct lbp_estimate *est, int deferred)
+{
+	est_cmddataouts (est, deferred, tm->check);
+	est->io++;
+	est->sleep += tm->data;
+	est->sleeps++;
+	est_cmdout (tm, est, deferred);
+	est_cmdout (tm, est, deferred);
+	est->io++;
+}
+
+static void est_data64out (const struct lbp_timing *tm,
+			  struct lbp_estimate *est, int deferred, int len)
+{
+	int i;
+	est_cmddataouts (est, deferred, tm->check);
+	for (i = 1; i < len; i += 2)
+	{
+		est->io++;
+		est_cmdout (tm, est, deferred);
+		est_cmddataouts (est, deferred, tm->check);
+		est->io++;
+		est_cmdout (tm, est, deferred);
+		est_cmddataouts (est, deferred, tm->check);
+	}
+	est->io++;
+	est_cmdout (tm, est, deferred);
+	est_cmdout (tm, est, deferred);
+	est->io++;
+}
+
+/* The band handshakes are strict whatever the policy */
+static void est_band (const struct lbp_printer *prt, struct lbp_estimate *est,
+		      int size, int type, int band)
+{
+	const struct lbp_timing *tm = &prt->timing;
+
+	/* init */
+	if (type == 1)
+	{
+		est_cmddataouts (est, 0, tm->init);
+		est->quick++;
+	} else {
+		est->io += 2;
+		est_cmddataouts (est, 0, tm->init);
+		est_cmdout (tm, est, 0);
+		est_cmddataouts (est, 0, tm->init);
+	}
+	est->io += 5;
+	est->wait += band ? prt->cost.band_ready : prt->cost.paper_feed;
+	/* data */
+	est->io += size * 4;
+	est->wire += size * 4;
+	/* trailer */
+	est->io++;
+	est_cmddataouts (est, 0, tm->trailer);
+	est->io++;
+	est_cmdout (tm, est, 0);
+	est_cmdout (tm, est, 0);
+	est->io++;
+	est->packets += size;
+}
+
+/* Walks the compressed page like print_page() does, without touching
+ * the port. The chunks are read without their packets.
+ */
+void lbp_estimate_page (const struct lbp_printer *prt, int deferred,
+			struct lbp_chunks *src, struct lbp_estimate *est)
+{
+	const struct lbp_timing *tm = &prt->timing;
+	const int *data = pagedata;
+	int offset = 0;
+	int len;
+	int size;
+
+	memset (est, 0, sizeof (*est));
+	while (1)
+	{
+		est_cmdout (tm, est, deferred);
+		est_cmdout (tm, est, deferred);
+
+		len = -data[offset];
+		if (len == 260)
+		{
+			offset = 0;
+			data = bandinit;
+		} else if (len > 255) {
+			if (src->read (src->arg, &size, NULL) <= 0)
+				break;
+			est_band (prt, est, size & 0xFFFF, 0, est->bands);
+			while ((size & 0x10000)
+			       && (src->read (src->arg, &size, NULL) > 0))
+				if (size & 0xFFFF)
+					est_band (prt, est, size & 0xFFFF,
+						  1, est->bands);
+			est->bands++;
+			offset++;
+		} else if (len > 1) {
+			est_data64out (tm, est, deferred, len);
+			offset += len + 1;
+		} else {
+			est_data6out (tm, est, deferred);
+			offset += 2;
+		}
+	}
+}
+
+long lbp_est_time (const struct lbp_printer *prt,
+		   const struct lbp_estimate *est)
+{
+	return est->io * prt->cost.port_io + est->sleep
+		+ est->sleeps * prt->cost.sleep_slack + est->wait;
+}
+
+/* Sets the costs measured in fit, the average of their samples. Returns
+ * the number of costs set, the others are left alone.
+ */
+int lbp_fit_cost (const struct lbp_fit *fit, struct lbp_cost *cost)
+{
+	int n = 0;
+
+	if (fit->busy_io && (fit->busy > 0))
+	{
+		cost->port_io = (fit->busy + fit->busy_io / 2) / fit->busy_io;
+		n++;
+	}
+	if (fit->sleeps && (fit->slept > fit->sleep))
+	{
+		cost->sleep_slack = (fit->slept - fit->sleep) / fit->sleeps;
+		n++;
+	}
+	if (fit->readies)
+	{
+		cost->band_ready = fit->ready / fit->readies;
+		n++;
+	}
+	if (fit->feeds)
+	{
+		cost->paper_feed = fit->feed / fit->feeds;
+		n++;
+	}
+	if (fit->resets)
+	{
+		cost->reset = fit->reset / fit->resets;
+		n++;
+	}
+	return n;
+}
+
+/* end of file */